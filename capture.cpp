@@ -0,0 +1,129 @@
+/*
+ * Multicomp MP7100  / OWON SP3051 / 3101 / 6031 / 5051
+ *
+ * Raw transport capture
+ *
+ * Hooked in to data_write() and device_fill(), so what ends
+ * up in the file is exactly what went over the wire and when,
+ * whichever acquisition mode or model profile was in use.
+ * See replay.cpp for playing it back.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "capture.h"
+#include "transport.h"
+
+static void capture_flush( struct capture_s *c, uint64_t now ) {
+	size_t done = 0;
+
+	while (done < c->used) {
+		ssize_t sz = write(c->fd, c->buf +done, c->used -done);
+		if (sz < 0) {
+			if (errno == EINTR) continue;
+			c->errors++;
+			break;
+		}
+		done += sz;
+	}
+	c->used = 0;
+	c->last_flush = now;
+}
+
+static void capture_put( struct capture_s *c, const void *b, size_t n ) {
+	if (c->used +n > CAP_BUFFER_SIZE) capture_flush(c, c->last_t);
+	memcpy(c->buf +c->used, b, n);
+	c->used += n;
+}
+
+/*
+ * Create (truncate) the capture file and write the header
+ * describing the devices
+ *
+ * Returns 0 on success, -1 with errno set
+ *
+ */
+int capture_open( struct capture_s *c, const char *path, struct device_s *devices, int ndev ) {
+	uint16_t n = ndev;
+
+	memset(c, 0, sizeof(*c));
+	c->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (c->fd < 0) return -1;
+
+	c->buf = (char *)malloc(CAP_BUFFER_SIZE);
+	if (!c->buf) {
+		close(c->fd);
+		c->fd = -1;
+		errno = ENOMEM;
+		return -1;
+	}
+
+	capture_put(c, CAP_MAGIC, CAP_MAGIC_SIZE);
+	capture_put(c, &n, sizeof(n));
+	for (int i = 0; i < ndev; i++) {
+		uint8_t mode = devices[i].comms_mode;
+		uint16_t len = strlen(devices[i].device);
+
+		capture_put(c, &mode, sizeof(mode));
+		capture_put(c, &len, sizeof(len));
+		capture_put(c, devices[i].device, len);
+	}
+	c->last_t = c->last_flush = monotonic_us();
+
+	return 0;
+}
+
+/*
+ * Record n bytes that just went to (CAP_TX) or came from
+ * (CAP_RX) device dev
+ *
+ */
+void capture_data( struct capture_s *c, int dev, int dir, const char *b, size_t n ) {
+	uint64_t now = monotonic_us();
+	uint64_t dt = now -c->last_t;
+	struct cap_rec_s r;
+
+	if (c->fd < 0) return;
+
+	r.dev = dev;
+	while (dt > UINT32_MAX) {
+		r.dt_us = UINT32_MAX;
+		r.dir = CAP_GAP;
+		r.len = 0;
+		capture_put(c, &r, sizeof(r));
+		dt -= UINT32_MAX;
+	}
+
+	r.dt_us = dt;
+	r.dir = dir;
+	do {
+		r.len = (n > CAP_MAX_RECORD)?CAP_MAX_RECORD:n;
+		if (sizeof(r) +r.len > CAP_BUFFER_SIZE -c->used) capture_flush(c, now);
+		capture_put(c, &r, sizeof(r));
+		capture_put(c, b, r.len);
+		b += r.len;
+		n -= r.len;
+		r.dt_us = 0;
+		c->records++;
+		c->bytes += r.len;
+	} while (n);
+	c->last_t = now;
+
+	if (now -c->last_flush >= CAP_FLUSH_INTERVAL) capture_flush(c, now);
+}
+
+void capture_close( struct capture_s *c ) {
+	if (c->fd < 0) return;
+
+	capture_flush(c, c->last_t);
+	close(c->fd);
+	c->fd = -1;
+	free(c->buf);
+	c->buf = NULL;
+}
@@ -0,0 +1,69 @@
+/*
+ * Multicomp MP7100  / OWON SP3051 / 3101 / 6031 / 5051
+ *
+ * Raw transport capture (-r) and its file format
+ *
+ */
+
+#ifndef MP7100_CAPTURE_H
+#define MP7100_CAPTURE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * A capture file, native byte order:
+ *
+ *   "MP71CAP1"
+ *   uint16_t ndev
+ *   ndev times: uint8_t comms_mode, uint16_t name length, name
+ *   records until EOF: struct cap_rec_s then len bytes
+ *
+ * Every byte written to or read from a device is recorded, in
+ * the order it happened, with the time since the previous
+ * record.  A silence longer than a uint32_t of microseconds is
+ * recorded as CAP_GAP records (no data).
+ *
+ */
+#define CAP_MAGIC "MP71CAP1"
+#define CAP_MAGIC_SIZE 8
+
+#define CAP_TX 0 // we sent it
+#define CAP_RX 1 // the device sent it
+#define CAP_GAP 2 // time only
+
+struct cap_rec_s {
+	uint32_t dt_us; // since the previous record
+	uint8_t dev;
+	uint8_t dir;
+	uint16_t len;
+};
+
+#define CAP_BUFFER_SIZE 65536
+#define CAP_MAX_RECORD 4096 // bytes of data per record, longer writes/reads are split
+#define CAP_FLUSH_INTERVAL 1000000 // us, longest a record sits in memory
+
+/*
+ * Buffered like the logger, written to from whichever thread
+ * is driving the devices (only ever one at a time)
+ *
+ */
+struct capture_s {
+	int fd;
+	char *buf;
+	size_t used;
+	uint64_t last_t; // of the previous record
+	uint64_t last_flush;
+
+	uint64_t records;
+	uint64_t bytes;
+	uint32_t errors;
+};
+
+struct device_s;
+
+int capture_open( struct capture_s *c, const char *path, struct device_s *devices, int ndev );
+void capture_data( struct capture_s *c, int dev, int dir, const char *b, size_t n );
+void capture_close( struct capture_s *c );
+
+#endif
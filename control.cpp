@@ -0,0 +1,411 @@
+/*
+ * Multicomp MP7100  / OWON SP3051 / 3101 / 6031 / 5051
+ *
+ * Setpoint and output control
+ *
+ * Changes come from the window's keys (posted from the render
+ * thread) or from local programs on the -C socket, one
+ * command per line
+ *
+ *   [<device>] VOLT <volts>
+ *   [<device>] CURR <amps>
+ *   [<device>] OUTP ON|OFF|TOGGLE
+ *
+ * answered with "OK" once queued or "ERR <reason>".  The
+ * device is the index of its -p, 0 if not given; a value with
+ * a sign, "VOLT +0.1", is a step from the current setpoint.
+ *
+ *   echo "VOLT 5.0" | socat - UNIX-CONNECT:/tmp/mp7100.ctl
+ *
+ * Nothing is written to a device from here: commands are
+ * merged in to its pending slots and the engine sends them
+ * ahead of its next measurement (see engine_commands()), so
+ * they never wait behind the sampling interval, only for the
+ * transaction already in flight.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "control.h"
+
+/*
+ * Put a change in its slot, a newer one for the same slot
+ * replaces it but keeps the original post time, that's how
+ * long the user has been waiting
+ *
+ */
+static void control_pend( struct device_s *d, int slot, int64_t value, uint64_t posted ) {
+	struct ctl_pending_s *p = &(d->pending[slot]);
+
+	if (!p->set) {
+		p->set = true;
+		p->posted = posted;
+		d->npending++;
+	}
+	p->value = value;
+}
+
+static void control_unpend( struct device_s *d, int slot ) {
+	if (!d->pending[slot].set) return;
+	d->pending[slot].set = false;
+	d->npending--;
+}
+
+/*
+ * Queue a change from the engine thread itself (the socket,
+ * ramp profiles), steps and toggles are resolved against the
+ * device's setpoints or whatever is already pending.
+ * cmd->posted is what the wait is measured from.
+ *
+ * Returns 0 on success, -1 with *why set
+ *
+ */
+int control_apply( struct control_s *c, const struct ctl_cmd_s *cmd, const char **why ) {
+	struct device_s *d;
+	int slot;
+	int64_t v;
+
+	if ((cmd->dev < 0)||(cmd->dev >= c->engine->ndev)) {
+		*why = "no such device";
+		return -1;
+	}
+	d = &(c->engine->devices[cmd->dev]);
+	if (d->replay) {
+		*why = "device is a replay";
+		return -1;
+	}
+	if (!d->online) {
+		*why = "device is offline";
+		return -1;
+	}
+
+	if (cmd->what == CTL_OUTPUT) {
+		bool on = cmd->value;
+
+		if (cmd->how == CTL_TOGGLE) {
+			/* not knowing what it is, off is the safe way to toggle */
+			if (d->pending[CTL_SLOT_ON].set) on = false;
+			else if (d->pending[CTL_SLOT_OFF].set) on = true;
+			else on = (d->output == 0);
+		}
+		control_unpend(d, on?CTL_SLOT_OFF:CTL_SLOT_ON);
+		control_pend(d, on?CTL_SLOT_ON:CTL_SLOT_OFF, 0, cmd->posted);
+		return 0;
+	}
+
+	slot = (cmd->what == CTL_VOLT)?CTL_SLOT_VOLT:CTL_SLOT_CURR;
+	v = cmd->value;
+	if (cmd->how == CTL_STEP) {
+		if (d->pending[slot].set) {
+			v += d->pending[slot].value;
+		} else if (d->have_setpoints) {
+			v += (cmd->what == CTL_VOLT)?d->set_uv:d->set_ua;
+		} else {
+			*why = "setpoints unknown, only absolute values";
+			return -1;
+		}
+	}
+	if (v < 0) v = 0;
+	control_pend(d, slot, v, cmd->posted);
+
+	return 0;
+}
+
+/*
+ * eventfd handler, collect whatever the other threads posted
+ *
+ */
+static void control_wake( void *arg, int fd, uint32_t events ) {
+	struct control_s *c = (struct control_s *)arg;
+	struct ctl_cmd_s cmds[CTL_INBOX_SIZE];
+	uint64_t v;
+	int n;
+	(void)events;
+
+	if (read(fd, &v, sizeof(v)) < 0) {
+		/* EAGAIN, someone else's wakeup already covered it */
+	}
+
+	pthread_mutex_lock(&(c->lock));
+	n = c->inbox_used;
+	memcpy(cmds, c->inbox, n *sizeof(struct ctl_cmd_s));
+	c->inbox_used = 0;
+	pthread_mutex_unlock(&(c->lock));
+
+	for (int i = 0; i < n; i++) {
+		const char *why;
+
+		if (control_apply(c, &(cmds[i]), &why) < 0) {
+			c->rejected++;
+			fprintf(stdout,"Ignoring command for device %d, %s\n", cmds[i].dev, why);
+		}
+	}
+}
+
+/*
+ * From any thread
+ *
+ * Returns false if the inbox is full, the engine isn't
+ * keeping up
+ *
+ */
+bool control_post( struct control_s *c, struct ctl_cmd_s *cmd ) {
+	uint64_t one = 1;
+	bool ok;
+
+	cmd->posted = monotonic_us();
+
+	pthread_mutex_lock(&(c->lock));
+	ok = (c->inbox_used < CTL_INBOX_SIZE);
+	if (ok) c->inbox[c->inbox_used++] = *cmd;
+	pthread_mutex_unlock(&(c->lock));
+
+	if (ok && (write(c->efd, &one, sizeof(one)) < 0)) {
+		/* only fails if the counter is saturated, it's awake anyway */
+	}
+
+	return ok;
+}
+
+/*
+ * One line from the socket, in place
+ *
+ * Returns 0 on success, -1 with *why set
+ *
+ */
+static int control_parse( char *line, struct ctl_cmd_s *cmd, const char **why ) {
+	char *tok[3], *save = NULL;
+	int n = 0, k = 0;
+
+	for (char *t = strtok_r(line, " \t\r", &save); t && (n < 3); t = strtok_r(NULL, " \t\r", &save)) tok[n++] = t;
+
+	memset(cmd, 0, sizeof(*cmd));
+	if ((n > 0) && (tok[0][0] >= '0') && (tok[0][0] <= '9')) {
+		cmd->dev = atoi(tok[0]);
+		k = 1;
+	}
+	if (n -k != 2) {
+		*why = "expected [<device>] VOLT|CURR|OUTP <value>";
+		return -1;
+	}
+
+	if (strncasecmp(tok[k], SET_OUTPUT, 4) == 0) {
+		const char *a = tok[k +1];
+
+		cmd->what = CTL_OUTPUT;
+		cmd->how = CTL_SET;
+		if ((strcasecmp(a, "ON") == 0)||(strcmp(a, "1") == 0)) cmd->value = 1;
+		else if ((strcasecmp(a, "OFF") == 0)||(strcmp(a, "0") == 0)) cmd->value = 0;
+		else if (strcasecmp(a, "TOGGLE") == 0) cmd->how = CTL_TOGGLE;
+		else {
+			*why = "OUTP takes ON, OFF or TOGGLE";
+			return -1;
+		}
+		return 0;
+	}
+
+	if (strncasecmp(tok[k], SET_VOLT, 4) == 0) cmd->what = CTL_VOLT;
+	else if (strncasecmp(tok[k], SET_CURR, 4) == 0) cmd->what = CTL_CURR;
+	else {
+		*why = "unknown command";
+		return -1;
+	}
+
+	if (parse_micro(tok[k +1], &(cmd->value)) < 0) {
+		*why = "not a number";
+		return -1;
+	}
+	cmd->how = ((tok[k +1][0] == '+')||(tok[k +1][0] == '-'))?CTL_STEP:CTL_SET;
+
+	return 0;
+}
+
+static void control_reply( struct ctl_client_s *cl, const char *why ) {
+	char b[CTL_LINE_MAX];
+	int n;
+
+	if (why) n = snprintf(b, sizeof(b), "ERR %s\n", why);
+	else n = snprintf(b, sizeof(b), "OK\n");
+
+	/* a client that doesn't read its answers just misses them */
+	if (send(cl->fd, b, n, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) return;
+}
+
+static void control_drop( struct control_s *c, struct ctl_client_s *cl ) {
+	engine_unwatch(c->engine, cl->fd);
+	close(cl->fd);
+	cl->fd = -1;
+}
+
+static void control_client_event( void *arg, int fd, uint32_t events ) {
+	struct control_s *c = (struct control_s *)arg;
+	struct ctl_client_s *cl = NULL;
+	ssize_t sz;
+
+	for (int i = 0; i < CTL_MAX_CLIENTS; i++) {
+		if (c->clients[i].fd == fd) cl = &(c->clients[i]);
+	}
+	if (!cl) return;
+
+	if (events & EPOLLIN) {
+		while ((sz = read(fd, cl->line +cl->used, sizeof(cl->line) -1 -cl->used)) > 0) {
+			char *p, *start = cl->line;
+
+			cl->used += sz;
+			cl->line[cl->used] = '\0';
+
+			while ((p = strchr(start, '\n'))) {
+				struct ctl_cmd_s cmd;
+				const char *why = NULL;
+
+				*p = '\0';
+				if (control_parse(start, &cmd, &why) == 0) {
+					cmd.posted = monotonic_us();
+					control_apply(c, &cmd, &why);
+				}
+				if (why) c->rejected++;
+				control_reply(cl, why);
+				start = p +1;
+			}
+
+			cl->used -= start -cl->line;
+			memmove(cl->line, start, cl->used);
+			if (cl->used == (int)sizeof(cl->line) -1) {
+				c->rejected++;
+				control_reply(cl, "line too long");
+				cl->used = 0;
+			}
+		}
+		if ((sz == 0)||((sz < 0) && (errno != EAGAIN) && (errno != EINTR))) {
+			control_drop(c, cl);
+			return;
+		}
+	}
+
+	if (events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP)) control_drop(c, cl);
+}
+
+static void control_accept( void *arg, int fd, uint32_t events ) {
+	struct control_s *c = (struct control_s *)arg;
+	(void)events;
+
+	for (;;) {
+		struct ctl_client_s *cl = NULL;
+		int cfd;
+
+		cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (cfd < 0) return;
+
+		for (int i = 0; i < CTL_MAX_CLIENTS; i++) {
+			if (c->clients[i].fd < 0) {
+				cl = &(c->clients[i]);
+				break;
+			}
+		}
+		if ((!cl)||(engine_watch(c->engine, cfd, EPOLLIN | EPOLLRDHUP, control_client_event, c) < 0)) {
+			close(cfd);
+			continue;
+		}
+		cl->fd = cfd;
+		cl->used = 0;
+	}
+}
+
+/*
+ * Set up the inbox and hook in to the engine
+ *
+ * Returns 0 on success, -1 with errno set
+ *
+ */
+int control_open( struct control_s *c, struct engine_s *e ) {
+	memset(c, 0, sizeof(*c));
+	c->engine = e;
+	c->fd = -1;
+	for (int i = 0; i < CTL_MAX_CLIENTS; i++) c->clients[i].fd = -1;
+	pthread_mutex_init(&(c->lock), NULL);
+
+	c->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (c->efd < 0) return -1;
+	if (engine_watch(e, c->efd, EPOLLIN, control_wake, c) < 0) {
+		int err = errno;
+
+		close(c->efd);
+		c->efd = -1;
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Take commands on a unix socket at path too (any stale
+ * socket there is replaced)
+ *
+ * Returns 0 on success, -1 with errno set
+ *
+ */
+int control_listen( struct control_s *c, const char *path ) {
+	struct sockaddr_un sa;
+
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", path);
+
+	c->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (c->fd < 0) return -1;
+
+	unlink(path);
+	if ((bind(c->fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+			|| (listen(c->fd, CTL_MAX_CLIENTS) < 0)
+			|| (engine_watch(c->engine, c->fd, EPOLLIN, control_accept, c) < 0)) {
+		int err = errno;
+
+		close(c->fd);
+		c->fd = -1;
+		errno = err;
+		return -1;
+	}
+	c->path = strdup(path);
+
+	return 0;
+}
+
+/*
+ * Only once the engine has stopped
+ *
+ */
+void control_close( struct control_s *c ) {
+	for (int i = 0; i < CTL_MAX_CLIENTS; i++) {
+		if (c->clients[i].fd >= 0) control_drop(c, &(c->clients[i]));
+	}
+
+	if (c->fd >= 0) {
+		engine_unwatch(c->engine, c->fd);
+		close(c->fd);
+		c->fd = -1;
+		if (c->path) unlink(c->path);
+	}
+	free(c->path);
+	c->path = NULL;
+
+	if (c->efd >= 0) {
+		engine_unwatch(c->engine, c->efd);
+		close(c->efd);
+		c->efd = -1;
+	}
+	pthread_mutex_destroy(&(c->lock));
+}
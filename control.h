@@ -0,0 +1,73 @@
+/*
+ * Multicomp MP7100  / OWON SP3051 / 3101 / 6031 / 5051
+ *
+ * Setpoint and output control, from the window's keys and
+ * the -C control socket
+ *
+ */
+
+#ifndef MP7100_CONTROL_H
+#define MP7100_CONTROL_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "engine.h"
+
+#define CTL_MAX_CLIENTS 8
+#define CTL_INBOX_SIZE 64 // commands posted from other threads, between engine passes
+#define CTL_LINE_MAX 128
+
+#define CTL_VOLT 0
+#define CTL_CURR 1
+#define CTL_OUTPUT 2
+
+#define CTL_SET 0 // value is the new setting
+#define CTL_STEP 1 // value is added to the setpoint
+#define CTL_TOGGLE 2 // output only
+
+struct ctl_cmd_s {
+	int dev;
+	int what; // CTL_VOLT / CTL_CURR / CTL_OUTPUT
+	int how; // CTL_SET / CTL_STEP / CTL_TOGGLE
+	int64_t value; // uV, uA, or 0/1 for the output
+	uint64_t posted; // monotonic us, filled in by control_post()
+};
+
+struct ctl_client_s {
+	int fd; // -1 = free slot
+	char line[CTL_LINE_MAX];
+	int used;
+};
+
+/*
+ * Commands from other threads (the window) go through the
+ * inbox and an eventfd wakes the engine to collect them, the
+ * socket is served on the engine thread itself.  Either way
+ * they end up in the device's pending slots (see
+ * transport.h) and go out as soon as the transaction in
+ * flight, if any, is done.
+ *
+ */
+struct control_s {
+	struct engine_s *engine;
+	int efd;
+
+	pthread_mutex_t lock;
+	struct ctl_cmd_s inbox[CTL_INBOX_SIZE];
+	int inbox_used;
+
+	int fd; // -C listening socket, -1 if none
+	char *path;
+	struct ctl_client_s clients[CTL_MAX_CLIENTS];
+
+	uint64_t rejected;
+};
+
+int control_open( struct control_s *c, struct engine_s *e );
+int control_listen( struct control_s *c, const char *path );
+bool control_post( struct control_s *c, struct ctl_cmd_s *cmd );
+int control_apply( struct control_s *c, const struct ctl_cmd_s *cmd, const char **why );
+void control_close( struct control_s *c );
+
+#endif
@@ -0,0 +1,685 @@
+/*
+ * Multicomp MP7100  / OWON SP3051 / 3101 / 6031 / 5051
+ *
+ * epoll driven acquisition engine
+ *
+ * Every device has at most one transaction in flight.  Serial
+ * ports and other pollable handles are registered with epoll
+ * and their responses are framed as they arrive, so one
+ * thread can keep any number of them busy.
+ *
+ * Real usbtmc nodes can't signal readiness for a plain read()
+ * (see usb_setup()).  If the instrument raises SRQ when it
+ * has an answer that comes in as EPOLLPRI and is treated the
+ * same way, otherwise the device gets a reader thread (see
+ * struct usb_reader_s) that waits on the status byte or the
+ * read() itself, and we wait on its eventfd.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <libgen.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+
+#include "engine.h"
+#include "models.h"
+
+#define ENGINE_INOTIFY_EVENTS (IN_CREATE | IN_ATTRIB | IN_MOVED_TO)
+
+/*
+ * Is the device read on its reader thread?
+ *
+ */
+static bool engine_threaded( struct device_s *d ) {
+	return (!d->pollable) && (d->usb_wait != USB_WAIT_SRQ);
+}
+
+/*
+ * Have epoll tell us when a device has something for us,
+ * keyed by its index.  A usbtmc instrument that raises SRQ
+ * when it has an answer counts, as EPOLLPRI, one that can't
+ * is read on its own thread and we're told through that.
+ *
+ * Returns 0 on success, -1 with errno set
+ *
+ */
+static int engine_listen( struct engine_s *e, int index ) {
+	struct device_s *d = &(e->devices[index]);
+	struct epoll_event ev;
+
+	if (d->fd < 0) return 0;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.data.u64 = index;
+
+	if (engine_threaded(d)) {
+		/* the reader and its eventfd outlive reconnects */
+		if (d->reader.started) return 0;
+		if (usb_reader_start(d) < 0) return -1;
+		ev.events = EPOLLIN;
+		return epoll_ctl(e->epfd, EPOLL_CTL_ADD, d->reader.efd, &ev);
+	}
+
+	ev.events = d->pollable?EPOLLIN:EPOLLPRI;
+	return epoll_ctl(e->epfd, EPOLL_CTL_ADD, d->fd, &ev);
+}
+
+/*
+ * Something was created in (or had its permissions changed
+ * in) a directory one of our devices lives in.  If it's an
+ * offline device's node, try it now rather than waiting out
+ * the backoff; udev creates the node and then fixes up its
+ * permissions, so an attempt on the first event can fail and
+ * the second one succeed.
+ *
+ */
+static void engine_inotify( void *arg, int fd, uint32_t events ) {
+	struct engine_s *e = (struct engine_s *)arg;
+	char b[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t sz;
+	(void)events;
+
+	while ((sz = read(fd, b, sizeof(b))) > 0) {
+		for (char *p = b; p < b +sz; ) {
+			struct inotify_event *ie = (struct inotify_event *)p;
+
+			p += sizeof(struct inotify_event) +ie->len;
+			if (!ie->len) continue;
+
+			for (int i = 0; i < e->ndev; i++) {
+				struct device_s *d = &(e->devices[i]);
+				const char *base = strrchr(d->device, '/');
+
+				base = base?base +1:d->device;
+				if ((!d->online) && (strcmp(base, ie->name) == 0)) d->reconnect_at = 0;
+			}
+		}
+	}
+}
+
+static void engine_timer( void *arg, int fd, uint32_t events ) {
+	struct engine_s *e = (struct engine_s *)arg;
+	uint64_t expirations;
+
+	(void)events;
+	if (read(fd, &expirations, sizeof(expirations)) < 0) return;
+	e->timer_at = 0;
+}
+
+/*
+ * Arm the timer for the absolute time t, if it isn't already
+ *
+ */
+static void engine_timer_arm( struct engine_s *e, uint64_t t ) {
+	struct itimerspec its;
+
+	if (t == e->timer_at) return;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = t /1000000;
+	its.it_value.tv_nsec = (t %1000000) *1000;
+	if (timerfd_settime(e->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) == 0) e->timer_at = t;
+}
+
+/*
+ * Returns 0 on success, -1 with errno set
+ *
+ */
+int engine_init( struct engine_s *e, struct device_s *devices, int ndev ) {
+	e->devices = devices;
+	e->ndev = ndev;
+	e->on_sample = NULL;
+	e->arg = NULL;
+	e->nidle = 0;
+	e->flat_out = false;
+
+	e->inotify_fd = -1;
+	e->timer_fd = -1;
+	e->timer_at = 0;
+	e->epfd = -1;
+	e->nwatches = ENGINE_WATCHES_INITIAL;
+	e->watches = (struct engine_watch_s *)malloc(e->nwatches *sizeof(struct engine_watch_s));
+	if (!e->watches) {
+		errno = ENOMEM;
+		return -1;
+	}
+	for (int i = 0; i < e->nwatches; i++) e->watches[i].fd = -1;
+
+	e->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (e->epfd < 0) return -1;
+
+	for (int i = 0; i < ndev; i++) {
+		if (engine_listen(e, i) < 0) return -1;
+	}
+
+	/*
+	 * Reconnects work without it, just not as promptly
+	 *
+	 */
+	e->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (e->inotify_fd >= 0) {
+		for (int i = 0; i < ndev; i++) {
+			char dir[4096];
+
+			snprintf(dir, sizeof(dir), "%s", devices[i].device);
+			inotify_add_watch(e->inotify_fd, dirname(dir), ENGINE_INOTIFY_EVENTS);
+		}
+		if (engine_watch(e, e->inotify_fd, EPOLLIN, engine_inotify, e) < 0) {
+			close(e->inotify_fd);
+			e->inotify_fd = -1;
+		}
+	}
+
+	/*
+	 * Sleeping in epoll_wait() alone rounds every deadline up
+	 * to the next ms, which at short -t is a large part of the
+	 * period.  Without the timer that's what we fall back to.
+	 *
+	 */
+	e->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (e->timer_fd >= 0) {
+		if (engine_watch(e, e->timer_fd, EPOLLIN, engine_timer, e) < 0) {
+			close(e->timer_fd);
+			e->timer_fd = -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Have handler called from the engine thread whenever fd has
+ * any of events
+ *
+ * Returns 0 on success, -1 with errno set
+ *
+ */
+int engine_watch( struct engine_s *e, int fd, uint32_t events, void (*handler)( void *arg, int fd, uint32_t events ), void *arg ) {
+	struct engine_watch_s *w = NULL;
+	struct epoll_event ev;
+	int i;
+
+	for (i = 0; i < e->nwatches; i++) {
+		if (e->watches[i].fd < 0) {
+			w = &(e->watches[i]);
+			break;
+		}
+	}
+
+	/*
+	 * Full, double it.  Entries are only looked up by index,
+	 * so moving them is fine.
+	 *
+	 */
+	if (!w) {
+		struct engine_watch_s *grown;
+
+		grown = (struct engine_watch_s *)realloc(e->watches, e->nwatches *2 *sizeof(struct engine_watch_s));
+		if (!grown) {
+			errno = ENOMEM;
+			return -1;
+		}
+		for (int j = e->nwatches; j < e->nwatches *2; j++) grown[j].fd = -1;
+		e->watches = grown;
+		i = e->nwatches;
+		e->nwatches *= 2;
+		w = &(e->watches[i]);
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.u64 = ENGINE_WATCH_KEY +i;
+	if (epoll_ctl(e->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) return -1;
+
+	w->fd = fd;
+	w->handler = handler;
+	w->arg = arg;
+	return 0;
+}
+
+/*
+ * Have handler called from the engine thread at the end of
+ * every pass, after those registered before it
+ *
+ * Returns 0 on success, -1 with errno set
+ *
+ */
+int engine_idle( struct engine_s *e, void (*handler)( void *arg ), void *arg ) {
+	if (e->nidle >= ENGINE_MAX_IDLE) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	e->idle[e->nidle].handler = handler;
+	e->idle[e->nidle].arg = arg;
+	e->nidle++;
+
+	return 0;
+}
+
+/*
+ * Change what a watched fd is waiting for
+ *
+ * Returns 0 on success, -1 with errno set
+ *
+ */
+int engine_watch_mod( struct engine_s *e, int fd, uint32_t events ) {
+	struct epoll_event ev;
+
+	for (int i = 0; i < e->nwatches; i++) {
+		if (e->watches[i].fd != fd) continue;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = events;
+		ev.data.u64 = ENGINE_WATCH_KEY +i;
+		return epoll_ctl(e->epfd, EPOLL_CTL_MOD, fd, &ev);
+	}
+
+	errno = ENOENT;
+	return -1;
+}
+
+/*
+ * Stop watching fd, call before closing it
+ *
+ */
+void engine_unwatch( struct engine_s *e, int fd ) {
+	for (int i = 0; i < e->nwatches; i++) {
+		if (e->watches[i].fd != fd) continue;
+
+		epoll_ctl(e->epfd, EPOLL_CTL_DEL, fd, NULL);
+		e->watches[i].fd = -1;
+		return;
+	}
+}
+
+void engine_close( struct engine_s *e ) {
+	for (int i = 0; i < e->ndev; i++) usb_reader_stop(&(e->devices[i]));
+	if (e->inotify_fd >= 0) close(e->inotify_fd);
+	e->inotify_fd = -1;
+	if (e->timer_fd >= 0) close(e->timer_fd);
+	e->timer_fd = -1;
+	if (e->epfd >= 0) close(e->epfd);
+	e->epfd = -1;
+	free(e->watches);
+	e->watches = NULL;
+	e->nwatches = 0;
+}
+
+/*
+ * How long until the device's next sample
+ *
+ * Normally the fixed interval.  In adaptive mode we sample
+ * back to back while volts or amps are moving faster than the
+ * thresholds (and for ADAPT_HOLD after), and drop to the
+ * keep-alive rate while they're flat.
+ *
+ * The rate is taken over at least ADAPT_SPAN, at full speed
+ * consecutive samples are so close together that the last
+ * digit flickering would look like a huge dV/dt.
+ *
+ */
+static uint64_t engine_interval( struct device_s *d, struct sample_s *smp, uint64_t now ) {
+	struct adapt_s *a = &(d->adapt);
+	double dt;
+
+	if (d->error_flag) return ERROR_RETRY_DELAY;
+	if (a->keepalive <= 0) return d->interval;
+
+	if (a->ref_t == 0) {
+		a->ref_uv = smp->uv;
+		a->ref_ua = smp->ua;
+		a->ref_t = now;
+		return 0;
+	}
+
+	if (now -a->ref_t >= ADAPT_SPAN) {
+		dt = (double)(now -a->ref_t); // uV per us is V/s
+		if ((llabs(smp->uv -a->ref_uv) /dt > a->dv)||(llabs(smp->ua -a->ref_ua) /dt > a->di)) {
+			a->fast_until = now +ADAPT_HOLD;
+		}
+		a->ref_uv = smp->uv;
+		a->ref_ua = smp->ua;
+		a->ref_t = now;
+	}
+
+	return (now < a->fast_until)?0:a->keepalive;
+}
+
+/*
+ * The device's handle has died, close it and schedule the
+ * first attempt to reopen it.  Until then the device's
+ * samples are flagged SAMPLE_OFFLINE.
+ *
+ */
+static void engine_offline( struct engine_s *e, struct device_s *d, uint64_t now ) {
+	if (d->fd >= 0) epoll_ctl(e->epfd, EPOLL_CTL_DEL, d->fd, NULL);
+	device_close(d);
+	rx_ring_reset(&(d->rx));
+	d->tx.state = TX_IDLE;
+
+	/* changes asked for before it went aren't applied to whatever comes back */
+	memset(d->pending, 0, sizeof(d->pending));
+	d->npending = 0;
+
+	d->online = false;
+	d->backoff = RECONNECT_MIN_DELAY;
+	d->reconnect_at = now +d->backoff;
+
+	if (d->replay) {
+		/* the capture has played out, there's nothing to reopen */
+		d->reconnect_at = UINT64_MAX;
+		return;
+	}
+
+	fprintf(stdout,"%s: Device lost (%s), reconnecting\n", d->device, strerror(d->tx.err));
+}
+
+/*
+ * Try to reopen an offline device, without blocking, backing
+ * off exponentially while it isn't there
+ *
+ */
+static void engine_reconnect( struct engine_s *e, struct device_s *d, uint64_t now ) {
+	if (device_open(d) == 0) {
+		if (engine_listen(e, d->index) == 0) {
+			d->online = true;
+			d->reconnects++;
+			d->next_due = now;
+			d->adapt.ref_t = 0;
+			fprintf(stdout,"%s: Reconnected\n", d->device);
+			return;
+		}
+		device_close(d);
+	}
+	if (d->debug) fprintf(stderr,"%s:%d: %s: reopen failed (%s)\n", FL, d->device, strerror(errno));
+
+	d->backoff *= 2;
+	if (d->backoff > RECONNECT_MAX_DELAY) d->backoff = RECONNECT_MAX_DELAY;
+	d->reconnect_at = now +d->backoff;
+}
+
+/*
+ * Schedule the device's next measurement
+ *
+ * With a steady period the next one is due a period after
+ * this one was due, not after it finished, so -t is the real
+ * sample period and the time taken by the transaction (and
+ * any latency waking up for it) doesn't accumulate.  A
+ * transaction that runs past the next slot doesn't stretch
+ * the period either: the slots it missed are counted as
+ * overruns and skipped, keeping the log on the same grid.
+ *
+ * Flat out, or when the period changes (adaptive mode,
+ * errors), the grid starts again from now.
+ *
+ */
+static void engine_schedule( struct engine_s *e, struct device_s *d, struct sample_s *smp, uint64_t now ) {
+	uint64_t period = engine_interval(d, smp, now);
+
+	if (e->flat_out) period = 0;
+
+	if ((period == 0)||(period != d->period)||(d->next_due == 0)) {
+		d->next_due = now +period;
+	} else {
+		d->next_due += period;
+		if (d->next_due < now) {
+			uint64_t missed = (now -d->next_due) /period +1;
+
+			d->overruns += missed;
+			d->next_due += missed *period;
+		}
+	}
+	d->period = period;
+}
+
+/*
+ * The earliest the device's next measurement can start: when
+ * it's due, but no sooner than its profile allows after the
+ * last thing we sent it
+ *
+ */
+static uint64_t engine_ready( struct engine_s *e, struct device_s *d ) {
+	uint64_t t = d->tx.start +d->profile->min_period;
+
+	if (e->flat_out) return d->next_due;
+
+	return (t > d->next_due)?t:d->next_due;
+}
+
+/*
+ * Hand the finished transaction to whoever is listening and
+ * schedule the device's next one
+ *
+ */
+static void engine_publish( struct engine_s *e, struct device_s *d, uint64_t now ) {
+	struct sample_s smp;
+
+	txn_sample(d, &smp, now);
+	if (d->error_flag && d->online && device_gone(d->tx.err)) engine_offline(e, d, now);
+	if (!d->online) smp.flags |= SAMPLE_OFFLINE;
+	if (!d->error_flag) perf_hist_add(&(d->latency), now -d->tx.start);
+	engine_schedule(e, d, &smp, now);
+	if (e->on_sample) e->on_sample(e->arg, d, &smp);
+}
+
+/*
+ * Send the device's pending setpoint and output changes, in
+ * slot order, while it has no transaction in flight.  They
+ * have no answers, so they take up no more than the min_period
+ * of the slot the next measurement would have had, and that
+ * measurement follows as soon as the profile allows.
+ *
+ */
+static void engine_commands( struct device_s *d, uint64_t now ) {
+	/* the measurement they go ahead of is held back by the same amount, see engine_ready() */
+	if (now < d->tx.start +d->profile->min_period) return;
+
+	for (int slot = 0; slot < CTL_SLOTS; slot++) {
+		struct ctl_pending_s *p = &(d->pending[slot]);
+
+		if (!p->set) continue;
+		p->set = false;
+		d->npending--;
+
+		if (device_set(d, slot, p->value) < 0) continue;
+		perf_hist_add(&(d->cmd_latency), now -p->posted);
+
+		switch (slot) {
+			case CTL_SLOT_OFF: d->output = 0; break;
+			case CTL_SLOT_ON: d->output = 1; break;
+			case CTL_SLOT_VOLT: d->set_uv = p->value; break;
+			case CTL_SLOT_CURR: d->set_ua = p->value; break;
+		}
+	}
+
+	/* they took up a slot of their own */
+	d->tx.start = now;
+}
+
+/*
+ * Move one device's transaction along as far as it will go
+ * without waiting
+ *
+ */
+static void engine_service( struct engine_s *e, struct device_s *d, uint64_t now ) {
+	struct txn_s *t = &(d->tx);
+
+	if (!d->online) {
+		if (now >= d->reconnect_at) engine_reconnect(e, d, now);
+		if (!d->online) return;
+	}
+
+	if (t->state == TX_IDLE) {
+		if (d->npending) engine_commands(d, now);
+		if (now < engine_ready(e, d)) return;
+		txn_begin(d, now);
+		if (t->state == TX_IDLE) {
+			engine_publish(e, d, now);
+			return;
+		}
+	}
+
+	if (t->state == TX_SETTLE) {
+		if (now < t->read_after) return;
+		t->state = TX_WAIT;
+	}
+
+	/* the ring is the reader's until it's done */
+	if (d->reader.busy) return;
+
+	while (t->state == TX_WAIT) {
+		char b[TXN_RESP_SIZE];
+		int r;
+
+		if (rx_ring_frame(&(d->rx), b, sizeof(b)) < 0) break;
+
+		r = txn_line(d, b, now);
+		if (r == TXN_DONE) {
+			engine_publish(e, d, now);
+			return;
+		}
+		if (r == TXN_RETRY) {
+			txn_begin(d, now);
+			if (t->state == TX_IDLE) engine_publish(e, d, now);
+			return;
+		}
+	}
+
+	if ((t->state == TX_WAIT) && (now >= t->deadline)) {
+		errno = ETIMEDOUT;
+		txn_fail(d);
+		engine_publish(e, d, now);
+		return;
+	}
+
+	/* each read is bounded by the driver timeout, and fails with ETIMEDOUT itself */
+	if ((t->state == TX_WAIT) && engine_threaded(d)) usb_reader_post(d);
+}
+
+/*
+ * When the device next needs our attention
+ *
+ */
+static uint64_t engine_next( struct engine_s *e, struct device_s *d ) {
+	if (!d->online) return d->reconnect_at;
+	switch (d->tx.state) {
+		case TX_IDLE:
+			if (d->npending) return d->tx.start +d->profile->min_period;
+			return engine_ready(e, d);
+		case TX_SETTLE: return d->tx.read_after;
+		default: return d->reader.busy?UINT64_MAX:d->tx.deadline;
+	}
+}
+
+/*
+ * Run until *quit is set
+ *
+ */
+void engine_run( struct engine_s *e, std::atomic<bool> *quit ) {
+	struct epoll_event ev[ENGINE_MAX_EVENTS];
+
+	while (!quit->load(std::memory_order_relaxed)) {
+		uint64_t now = monotonic_us();
+		uint64_t wake = now +ENGINE_MAX_WAIT;
+		int n, ms;
+
+		for (int i = 0; i < e->ndev; i++) {
+			struct device_s *d = &(e->devices[i]);
+			uint64_t t;
+
+			engine_service(e, d, now);
+			t = engine_next(e, d);
+			if (t < wake) wake = t;
+		}
+
+		for (int i = 0; i < e->nidle; i++) e->idle[i].handler(e->idle[i].arg);
+
+		now = monotonic_us();
+		if (wake <= now) {
+			ms = 0;
+		} else if (e->timer_fd >= 0) {
+			engine_timer_arm(e, wake);
+			ms = -1;
+		} else {
+			ms = (wake -now +999) /1000;
+		}
+		n = epoll_wait(e->epfd, ev, ENGINE_MAX_EVENTS, ms);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			fprintf(stderr,"%s:%d: epoll_wait failed (%s)\n", FL, strerror(errno));
+			break;
+		}
+
+		for (int i = 0; i < n; i++) {
+			struct device_s *d;
+
+			if (ev[i].data.u64 >= ENGINE_WATCH_KEY) {
+				uint64_t k = ev[i].data.u64 -ENGINE_WATCH_KEY;
+				struct engine_watch_s *w;
+
+				if (k >= (uint64_t)e->nwatches) continue;
+				w = &(e->watches[k]);
+				if (w->fd >= 0) w->handler(w->arg, w->fd, ev[i].events);
+				continue;
+			}
+
+			d = &(e->devices[ev[i].data.u64]);
+
+			if (d->reader.busy) {
+				/* framed on the next pass */
+				if ((usb_reader_collect(d) < 0) && (errno != EAGAIN)) {
+					txn_fail(d);
+					engine_publish(e, d, monotonic_us());
+				}
+				continue;
+			}
+			if (!d->online) continue;
+
+			if (!d->pollable) {
+				/*
+				 * SRQ from a usbtmc instrument: acknowledge it, and
+				 * if it says there's a message the read() won't block
+				 *
+				 */
+				int stb = usb_srq_ack(d);
+
+				if ((stb >= 0) && (!(stb & USBTMC_STB_MAV))) continue;
+				if ((stb < 0) && (!device_gone(errno))) continue;
+			}
+
+			if (device_fill(d, !d->pollable) < 0) {
+				if ((errno == EINTR)||(errno == EAGAIN)) continue;
+
+				/*
+				 * The handle is dead (unplugged, far end of a pty
+				 * closed), whatever the reason epoll will keep
+				 * telling us about it until it's closed.  For a
+				 * replay it's just the end of the capture, not
+				 * something to report.
+				 *
+				 */
+				if (d->replay) {
+					d->error_flag = true;
+					d->tx.fail = SAMPLE_NODATA;
+				} else {
+					txn_fail(d);
+				}
+				now = monotonic_us();
+				engine_offline(e, d, now);
+				engine_publish(e, d, now);
+				continue;
+			}
+
+			if (d->tx.state == TX_IDLE) {
+				/* nobody asked, it's stale */
+				rx_ring_reset(&(d->rx));
+			}
+		}
+	}
+}
@@ -0,0 +1,78 @@
+/*
+ * Multicomp MP7100  / OWON SP3051 / 3101 / 6031 / 5051
+ *
+ * epoll driven acquisition engine, keeps one transaction in
+ * flight per device for any number of devices from a single
+ * thread.
+ *
+ */
+
+#ifndef MP7100_ENGINE_H
+#define MP7100_ENGINE_H
+
+#include <atomic>
+#include <sys/epoll.h>
+
+#include "transport.h"
+
+#define ENGINE_MAX_WAIT 50000 // us, longest we sleep before checking for quit
+#define ENGINE_MAX_EVENTS 64
+#define ENGINE_WATCHES_INITIAL 16 // the table doubles when it fills
+#define ENGINE_MAX_IDLE 8
+#define ENGINE_WATCH_KEY 0x100000000ULL // epoll keys below this are device indexes
+
+/*
+ * Anything else (sockets, timers) that wants to be serviced
+ * from the engine thread
+ *
+ */
+struct engine_watch_s {
+	int fd; // -1 = free slot
+	void (*handler)( void *arg, int fd, uint32_t events );
+	void *arg;
+};
+
+struct engine_idle_s {
+	void (*handler)( void *arg );
+	void *arg;
+};
+
+struct engine_s {
+	int epfd;
+	int inotify_fd; // wakes reconnects when device nodes appear, -1 if unavailable
+	int timer_fd; // wakes us at the next deadline to the us, -1 = epoll's ms timeout
+	uint64_t timer_at; // deadline it's armed for, 0 = none
+	bool flat_out; // ignore intervals and rate limits, for fast replays
+	struct device_s *devices;
+	int ndev;
+
+	/*
+	 * Called from the engine thread for every completed (or
+	 * failed) transaction
+	 *
+	 */
+	void (*on_sample)( void *arg, struct device_s *d, struct sample_s *smp );
+	void *arg;
+
+	/*
+	 * Called from the engine thread once per pass, just before
+	 * it goes to sleep, so work queued by on_sample can be
+	 * done in batches, see engine_idle()
+	 *
+	 */
+	struct engine_idle_s idle[ENGINE_MAX_IDLE];
+	int nidle;
+
+	struct engine_watch_s *watches;
+	int nwatches;
+};
+
+int engine_init( struct engine_s *e, struct device_s *devices, int ndev );
+int engine_watch( struct engine_s *e, int fd, uint32_t events, void (*handler)( void *arg, int fd, uint32_t events ), void *arg );
+int engine_idle( struct engine_s *e, void (*handler)( void *arg ), void *arg );
+int engine_watch_mod( struct engine_s *e, int fd, uint32_t events );
+void engine_unwatch( struct engine_s *e, int fd );
+void engine_run( struct engine_s *e, std::atomic<bool> *quit );
+void engine_close( struct engine_s *e );
+
+#endif
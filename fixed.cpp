@@ -0,0 +1,189 @@
+/*
+ * Multicomp MP7100  / OWON SP3051 / 3101 / 6031 / 5051
+ *
+ * Fixed point parse and format
+ *
+ * Neither side touches the locale, the heap or stdio, so
+ * they're safe and cheap to call from the acquisition
+ * thread for every sample.
+ *
+ */
+
+#include <string.h>
+
+#include "fixed.h"
+
+#define FIXED_MAX_DIGITS 18 // significant digits kept, more can't fit a uint64_t safely
+
+static const uint64_t pow10_tab[20] = {
+	1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+	10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+	100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+	100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+	100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL
+};
+
+static const char digit_pairs[201] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+/*
+ * Parse a SCPI numeric response ("12.000", "+1.2000E+01",
+ * "-.5", " 3 ") in to micro units, rounding half away from
+ * zero.  A single trailing unit letter (V, A or W) is
+ * tolerated as some firmware sends one.
+ *
+ * Returns 0 on success, -1 if the text isn't a number we can
+ * represent (empty, junk, out of range, SCPI overflow/NaN)
+ *
+ */
+int parse_micro( const char *s, int64_t *out ) {
+	uint64_t mant = 0;
+	int exp10 = 6; // we want micro units
+	int digits = 0;
+	bool neg = false;
+	bool any = false;
+
+	while ((*s == ' ')||(*s == '\t')) s++;
+	if ((*s == '+')||(*s == '-')) {
+		neg = (*s == '-');
+		s++;
+	}
+
+	for (; (*s >= '0')&&(*s <= '9'); s++) {
+		any = true;
+		if (digits < FIXED_MAX_DIGITS) {
+			mant = mant *10 +(*s -'0');
+			if (mant) digits++;
+		} else {
+			exp10++;
+		}
+	}
+
+	if (*s == '.') {
+		for (s++; (*s >= '0')&&(*s <= '9'); s++) {
+			any = true;
+			if (digits < FIXED_MAX_DIGITS) {
+				mant = mant *10 +(*s -'0');
+				if (mant) digits++;
+				exp10--;
+			}
+		}
+	}
+	if (!any) return -1;
+
+	if ((*s == 'e')||(*s == 'E')) {
+		bool eneg = false;
+		int e = 0;
+
+		s++;
+		if ((*s == '+')||(*s == '-')) {
+			eneg = (*s == '-');
+			s++;
+		}
+		if ((*s < '0')||(*s > '9')) return -1;
+		for (; (*s >= '0')&&(*s <= '9'); s++) {
+			if (e < 1000) e = e *10 +(*s -'0');
+		}
+		exp10 += eneg?-e:e;
+	}
+
+	if ((*s == 'V')||(*s == 'A')||(*s == 'W')) s++;
+	while ((*s == ' ')||(*s == '\t')||(*s == '\r')||(*s == '\n')) s++;
+	if (*s) return -1;
+
+	if (mant == 0) {
+		*out = 0;
+		return 0;
+	}
+
+	if (exp10 >= 0) {
+		if ((exp10 > 18)||(mant > (uint64_t)FIXED_LIMIT /pow10_tab[exp10])) return -1;
+		mant *= pow10_tab[exp10];
+	} else if (exp10 < -19) {
+		mant = 0;
+	} else {
+		uint64_t p = pow10_tab[-exp10];
+		mant = (mant +p /2) /p;
+	}
+	if (mant > (uint64_t)FIXED_LIMIT) return -1;
+
+	*out = neg?-(int64_t)mant:(int64_t)mant;
+
+	return 0;
+}
+
+/*
+ * Format micro units with the given number of decimals
+ * (0..6, rounded half away from zero), right aligned in at
+ * least width characters.
+ *
+ * Returns the length written, or -1 (b untouched) if it
+ * doesn't fit in s.
+ *
+ */
+int format_micro( char *b, size_t s, int64_t v, int decimals, int width ) {
+	char tmp[32];
+	char *p = tmp +sizeof(tmp);
+	uint64_t u, ip, fp, unit;
+	int len, pad;
+
+	if (decimals < 0) decimals = 0;
+	if (decimals > 6) decimals = 6;
+
+	u = (v < 0)?(uint64_t)(-(v +1)) +1:(uint64_t)v;
+	unit = pow10_tab[6 -decimals];
+	u = (u +unit /2) /unit;
+	ip = u /pow10_tab[decimals];
+	fp = u %pow10_tab[decimals];
+
+	/*
+	 * Build it backwards, two digits at a time from the pairs
+	 * table
+	 *
+	 */
+	if (decimals) {
+		int n = decimals;
+
+		while (n >= 2) {
+			p -= 2;
+			memcpy(p, digit_pairs +(fp %100) *2, 2);
+			fp /= 100;
+			n -= 2;
+		}
+		if (n) *--p = '0' +(fp %10);
+		*--p = '.';
+	}
+
+	while (ip >= 100) {
+		p -= 2;
+		memcpy(p, digit_pairs +(ip %100) *2, 2);
+		ip /= 100;
+	}
+	if (ip >= 10) {
+		p -= 2;
+		memcpy(p, digit_pairs +ip *2, 2);
+	} else {
+		*--p = '0' +ip;
+	}
+
+	if ((v < 0)&&(u != 0)) *--p = '-';
+
+	len = tmp +sizeof(tmp) -p;
+	pad = (width > len)?width -len:0;
+	if ((size_t)(len +pad) >= s) return -1;
+
+	memset(b, ' ', pad);
+	memcpy(b +pad, p, len);
+	b[pad +len] = '\0';
+
+	return pad +len;
+}
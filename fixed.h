@@ -0,0 +1,29 @@
+/*
+ * Multicomp MP7100  / OWON SP3051 / 3101 / 6031 / 5051
+ *
+ * Fixed point readings.  Volts and amps are carried as
+ * integer micro-volts / micro-amps from the moment the
+ * response is parsed; only the display and log turn them
+ * back in to text.
+ *
+ */
+
+#ifndef MP7100_FIXED_H
+#define MP7100_FIXED_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MICRO 1000000LL
+
+/*
+ * Largest magnitude we'll accept, 9 million volts/amps is
+ * already absurd and keeps every later sum well inside int64
+ *
+ */
+#define FIXED_LIMIT (9000000LL *MICRO)
+
+int parse_micro( const char *s, int64_t *out );
+int format_micro( char *b, size_t s, int64_t v, int decimals, int width );
+
+#endif
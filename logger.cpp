@@ -0,0 +1,185 @@
+/*
+ * Multicomp MP7100  / OWON SP3051 / 3101 / 6031 / 5051
+ *
+ * Streaming sample logger
+ *
+ * One line per sample:
+ *
+ *   <monotonic seconds>,<unix seconds>,<device>,<volts>,<amps>
+ *
+ * device is the index of the -p it came from.
+ *
+ * volts/amps are left empty for samples that failed.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "logger.h"
+#include "fixed.h"
+
+/*
+ * Open (append to) the log file
+ *
+ * Returns 0 on success, -1 with errno set
+ *
+ */
+int logger_open( struct logger_s *l, const char *path, int fsync_ms ) {
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0) return -1;
+
+	return logger_open_fd(l, fd, fsync_ms);
+}
+
+/*
+ * Log to an already open descriptor (eg stdout), which the
+ * logger then owns.  The header goes out if it's empty, which
+ * a pipe always is.
+ *
+ * Returns 0 on success, -1 with errno set
+ *
+ */
+int logger_open_fd( struct logger_s *l, int fd, int fsync_ms ) {
+	struct stat st;
+
+	memset(l, 0, sizeof(*l));
+	l->fd = fd;
+
+	l->buf = (char *)malloc(LOG_BUFFER_SIZE);
+	if (!l->buf) {
+		close(l->fd);
+		l->fd = -1;
+		errno = ENOMEM;
+		return -1;
+	}
+
+	l->fsync_interval = (fsync_ms > 0)?(uint64_t)fsync_ms *1000:0;
+
+	if ((fstat(l->fd, &st) == 0) && (st.st_size == 0)) {
+		memcpy(l->buf, LOG_HEADER, sizeof(LOG_HEADER) -1);
+		l->used = sizeof(LOG_HEADER) -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Write out everything buffered, and fdatasync() if it's
+ * been long enough since the last one.
+ *
+ * Returns 0 on success, -1 if the write failed (the batch is
+ * dropped, we carry on with the next)
+ *
+ */
+int logger_flush( struct logger_s *l, uint64_t now ) {
+	size_t done = 0;
+	int r = 0;
+
+	while (done < l->used) {
+		ssize_t sz = write(l->fd, l->buf +done, l->used -done);
+		if (sz < 0) {
+			if (errno == EINTR) continue;
+			l->errors++;
+			r = -1;
+			break;
+		}
+		done += sz;
+	}
+	if (l->used) {
+		l->flushes++;
+		l->unsynced = true;
+	}
+	l->used = 0;
+	l->last_flush = now;
+
+	if (l->fsync_interval && l->unsynced && (now -l->last_fsync >= l->fsync_interval)) {
+		if (fdatasync(l->fd) == 0) l->fsyncs++;
+		else l->errors++;
+		l->last_fsync = now;
+		l->unsynced = false;
+	}
+
+	return r;
+}
+
+/*
+ * Format one sample as a log line (with the newline) in to b
+ *
+ * Returns the length, truncated to fit s
+ *
+ */
+int logger_format( char *b, size_t s, const struct sample_s *smp ) {
+	int n;
+
+	if (smp->flags & SAMPLE_ERROR) {
+		n = snprintf(b, s, "%llu.%06llu,%llu.%06llu,%u,,\n"
+				, (unsigned long long)(smp->t_us /1000000), (unsigned long long)(smp->t_us %1000000)
+				, (unsigned long long)(smp->wall_us /1000000), (unsigned long long)(smp->wall_us %1000000)
+				, smp->dev
+				);
+	} else {
+		char v[24], a[24];
+
+		format_micro(v, sizeof(v), smp->uv, 6, 0);
+		format_micro(a, sizeof(a), smp->ua, 6, 0);
+		n = snprintf(b, s, "%llu.%06llu,%llu.%06llu,%u,%s,%s\n"
+				, (unsigned long long)(smp->t_us /1000000), (unsigned long long)(smp->t_us %1000000)
+				, (unsigned long long)(smp->wall_us /1000000), (unsigned long long)(smp->wall_us %1000000)
+				, smp->dev
+				, v, a
+				);
+	}
+	if (n < 0) return 0;
+	if ((size_t)n >= s) n = s -1;
+
+	return n;
+}
+
+/*
+ * Append one sample, only touches the file when the buffer
+ * fills or the flush interval has passed
+ *
+ */
+void logger_sample( struct logger_s *l, const struct sample_s *smp ) {
+	int n;
+
+	if (l->fd < 0) return;
+	if (l->used +LOG_LINE_MAX > LOG_BUFFER_SIZE) logger_flush(l, smp->t_us);
+
+	n = logger_format(l->buf +l->used, LOG_LINE_MAX, smp);
+	if (n > 0) {
+		l->used += n;
+		l->lines++;
+	}
+
+	if (smp->t_us -l->last_flush >= LOG_FLUSH_INTERVAL) logger_flush(l, smp->t_us);
+}
+
+/*
+ * Flush if the interval has passed, for when there are no
+ * samples arriving to do it (devices offline, long -t)
+ *
+ */
+void logger_tick( struct logger_s *l, uint64_t now ) {
+	if (l->fd < 0) return;
+	if ((l->used || l->unsynced) && (now -l->last_flush >= LOG_FLUSH_INTERVAL)) logger_flush(l, now);
+}
+
+void logger_close( struct logger_s *l ) {
+	if (l->fd < 0) return;
+
+	logger_flush(l, l->last_flush);
+	if (l->fsync_interval) fdatasync(l->fd);
+	close(l->fd);
+	l->fd = -1;
+	free(l->buf);
+	l->buf = NULL;
+}
@@ -0,0 +1,53 @@
+/*
+ * Multicomp MP7100  / OWON SP3051 / 3101 / 6031 / 5051
+ *
+ * Streaming sample logger
+ *
+ */
+
+#ifndef MP7100_LOGGER_H
+#define MP7100_LOGGER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "sample.h"
+
+#define LOG_BUFFER_SIZE 65536
+#define LOG_FLUSH_INTERVAL 1000000 // us, longest a line sits in memory
+#define LOG_LINE_MAX 128
+#define LOG_HEADER "# mono_s,wall_s,device,volts,amps\n"
+
+/*
+ * Samples are formatted in to buf and written out in one
+ * go when it fills or LOG_FLUSH_INTERVAL passes.  If
+ * fsync_interval is set the file is also fdatasync()'d at
+ * most that often, so durability costs one syscall per
+ * batch instead of one per sample.
+ *
+ */
+struct logger_s {
+	int fd;
+	char *buf;
+	size_t used;
+
+	uint64_t fsync_interval; // us, 0 = leave it to the kernel
+	uint64_t last_flush;
+	uint64_t last_fsync;
+	bool unsynced;
+
+	uint64_t lines;
+	uint64_t flushes;
+	uint64_t fsyncs;
+	uint32_t errors;
+};
+
+int logger_open( struct logger_s *l, const char *path, int fsync_ms );
+int logger_open_fd( struct logger_s *l, int fd, int fsync_ms );
+int logger_format( char *b, size_t s, const struct sample_s *smp );
+void logger_sample( struct logger_s *l, const struct sample_s *smp );
+int logger_flush( struct logger_s *l, uint64_t now );
+void logger_tick( struct logger_s *l, uint64_t now );
+void logger_close( struct logger_s *l );
+
+#endif
@@ -0,0 +1,74 @@
+/*
+ * Multicomp MP7100  / OWON SP3051 / 3101 / 6031 / 5051
+ *
+ * Per model capability profiles
+ *
+ * At start up every device is asked *IDN? and the model field
+ * of the answer picks its profile (see device_identify()),
+ * anything we don't recognise gets the generic one, which is
+ * what every device used to be driven with.
+ *
+ * The rates are conservative defaults, not measured against
+ * each model, tighten them once they've been tested on real
+ * hardware.  The legacy settle delay is only used with
+ * -a legacy.
+ *
+ */
+
+#ifndef MP7100_MODELS_H
+#define MP7100_MODELS_H
+
+#include "transport.h"
+
+struct model_profile_s {
+	const char *match; // substring of the *IDN? model field, nullptr for the generic profile
+	const char *name;
+
+	const char *meas_volt;
+	const char *meas_curr;
+	const char *meas_all; // volts and amps in one query
+	const char *set_volt; // setpoint commands, the query is the same with '?'
+	const char *set_curr;
+	const char *output;
+	const char *term; // serial line terminator, usbtmc is message based
+
+	int acq_mode; // fastest mode the model handles
+	int min_period; // us from one query to the next, 0 = as fast as it answers
+	int settle; // us between query and read for ACQ_LEGACY
+	int v_decimals, a_decimals; // readback resolution
+};
+
+static constexpr struct model_profile_s model_profiles[] = {
+	{ nullptr, "generic SCPI", MEAS_VOLT, MEAS_CURR, MEAS_ALL, SET_VOLT, SET_CURR, SET_OUTPUT, "\n", ACQ_COMPOUND, 0, LEGACY_SETTLE_DELAY, 3, 3 },
+	{ "MP7100", "Multicomp MP7100", MEAS_VOLT, MEAS_CURR, MEAS_ALL, SET_VOLT, SET_CURR, SET_OUTPUT, "\n", ACQ_COMPOUND, 5000, LEGACY_SETTLE_DELAY, 3, 3 },
+	{ "SP3051", "OWON SP3051", MEAS_VOLT, MEAS_CURR, MEAS_ALL, SET_VOLT, SET_CURR, SET_OUTPUT, "\n", ACQ_ALL, 2000, 10000, 3, 3 },
+	{ "SP3101", "OWON SP3101", MEAS_VOLT, MEAS_CURR, MEAS_ALL, SET_VOLT, SET_CURR, SET_OUTPUT, "\n", ACQ_ALL, 2000, 10000, 3, 3 },
+	{ "SP6031", "OWON SP6031", MEAS_VOLT, MEAS_CURR, MEAS_ALL, SET_VOLT, SET_CURR, SET_OUTPUT, "\n", ACQ_ALL, 2000, 10000, 3, 3 },
+	{ "SP5051", "OWON SP5051", MEAS_VOLT, MEAS_CURR, MEAS_ALL, SET_VOLT, SET_CURR, SET_OUTPUT, "\n", ACQ_ALL, 2000, 10000, 3, 3 },
+};
+
+#define MODEL_PROFILES (sizeof(model_profiles) /sizeof(model_profiles[0]))
+
+/*
+ * Catch a bad table entry at compile time rather than on the
+ * bench
+ *
+ */
+static constexpr bool model_profiles_ok( void ) {
+	if (model_profiles[0].match != nullptr) return false;
+	for (size_t i = 0; i < MODEL_PROFILES; i++) {
+		const struct model_profile_s &p = model_profiles[i];
+
+		if ((i > 0) && (p.match == nullptr)) return false;
+		if ((!p.meas_volt)||(!p.meas_curr)||(!p.meas_all)||(!p.term)) return false;
+		if ((!p.set_volt)||(!p.set_curr)||(!p.output)) return false;
+		if ((p.acq_mode < ACQ_LEGACY)||(p.acq_mode > ACQ_ALL)) return false;
+		if ((p.min_period < 0)||(p.settle < 0)) return false;
+		if ((p.v_decimals < 0)||(p.v_decimals > 6)||(p.a_decimals < 0)||(p.a_decimals > 6)) return false;
+	}
+	return true;
+}
+
+static_assert(model_profiles_ok(), "model_profiles: the generic profile must come first and every entry be complete");
+
+#endif
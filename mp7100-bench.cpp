@@ -0,0 +1,352 @@
+/*
+ * Multicomp MP7100  / OWON SP3051 / 3101 / 6031 / 5051
+ *
+ * Acquisition benchmark
+ *
+ * Starts mp7100-sim and drives the real transport code
+ * (acquire(), so data_write()/data_read()) against it, over a
+ * serial pty and over the simulator's message based socket
+ * standing in for a usbtmc node.  For each transport, mode
+ * and interval it reports the achieved sample rate, the
+ * transaction latency percentiles and CPU used per sample.
+ *
+ *   make bench
+ *   ./mp7100-bench -m pipeline,compound -i 0,10000 -n 500 -l 2000
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+
+#include "transport.h"
+
+#define BENCH_MAX_RUNS 16
+#define BENCH_STARTUP_WAIT 2000000 // us to wait for the simulator to come up
+
+struct bench_glb {
+	char *sim_path;
+	int samples;
+	int latency; // us, passed to the simulator
+	int jitter;
+	double error_rate;
+	int io_timeout;
+
+	int modes[BENCH_MAX_RUNS];
+	int nmodes;
+	int intervals[BENCH_MAX_RUNS];
+	int nintervals;
+	bool serial, usbtmc;
+
+	char dir[64];
+	char pty_link[128];
+	char sock_path[100]; // has to fit sockaddr_un.sun_path
+	pid_t sim_pid;
+};
+
+struct bench_result_s {
+	int samples;
+	int errors;
+	double rate;
+	uint32_t p50, p99, max; // us
+	double cpu; // us per sample
+};
+
+static const char *mode_names[] = { "legacy", "pipeline", "compound", "all" };
+
+void bench_init( struct bench_glb *g ) {
+	g->sim_path = (char *)"./mp7100-sim";
+	g->samples = 1000;
+	g->latency = 0;
+	g->jitter = 0;
+	g->error_rate = 0.0;
+	g->io_timeout = IO_TIMEOUT_DEFAULT;
+
+	g->modes[0] = ACQ_PIPELINE;
+	g->modes[1] = ACQ_COMPOUND;
+	g->modes[2] = ACQ_ALL;
+	g->nmodes = 3;
+	g->intervals[0] = 0;
+	g->intervals[1] = 1000;
+	g->intervals[2] = 10000;
+	g->nintervals = 3;
+	g->serial = g->usbtmc = true;
+
+	g->sim_pid = -1;
+}
+
+void bench_show_help( void ) {
+	fprintf(stdout,"MP7100 acquisition benchmark\r\n"
+			"\r\n"
+			"\t-h: This help\r\n"
+			"\t-s <path> (simulator binary, default ./mp7100-sim)\r\n"
+			"\t-n <samples> (per run, default 1000)\r\n"
+			"\t-m <modes> (comma list of legacy,pipeline,compound,all; default pipeline,compound,all)\r\n"
+			"\t-i <intervals> (comma list, us between samples; default 0,1000,10000)\r\n"
+			"\t-t <serial|usbtmc> (only bench one transport)\r\n"
+			"\t-l <latency> (simulated device latency us, default 0)\r\n"
+			"\t-j <jitter> (simulated latency jitter us, default 0)\r\n"
+			"\t-e <percent> (simulated error rate, default 0)\r\n"
+			"\t-T <timeout> (ms allowed per transaction, default %d)\r\n"
+			, IO_TIMEOUT_DEFAULT
+			);
+}
+
+/*
+ * Comma separated list of either numbers or mode names
+ *
+ */
+int bench_list( char *s, int *out, bool names ) {
+	int n = 0;
+	char *save = NULL;
+
+	for (char *t = strtok_r(s, ",", &save); t && (n < BENCH_MAX_RUNS); t = strtok_r(NULL, ",", &save)) {
+		if (names) {
+			for (int m = 0; m < 4; m++) {
+				if (strcmp(t, mode_names[m]) == 0) out[n++] = m;
+			}
+		} else {
+			out[n++] = atoi(t);
+		}
+	}
+
+	return n;
+}
+
+int bench_parse_parameters( struct bench_glb *g, int argc, char **argv ) {
+	for (int i = 1; i < argc; i++) {
+		if (argv[i][0] != '-') continue;
+
+		if ((argv[i][1] != 'h') && (i +1 >= argc)) {
+			fprintf(stdout,"Insufficient parameters; %s needs a value\n", argv[i]);
+			exit(1);
+		}
+
+		switch (argv[i][1]) {
+			case 'h': bench_show_help(); exit(1); break;
+			case 's': g->sim_path = argv[++i]; break;
+			case 'n': g->samples = atoi(argv[++i]); break;
+			case 'm': g->nmodes = bench_list(argv[++i], g->modes, true); break;
+			case 'i': g->nintervals = bench_list(argv[++i], g->intervals, false); break;
+			case 't':
+					  i++;
+					  g->serial = (strcmp(argv[i], "serial") == 0);
+					  g->usbtmc = (strcmp(argv[i], "usbtmc") == 0);
+					  break;
+			case 'l': g->latency = atoi(argv[++i]); break;
+			case 'j': g->jitter = atoi(argv[++i]); break;
+			case 'e': g->error_rate = atof(argv[++i]); break;
+			case 'T': g->io_timeout = atoi(argv[++i]); break;
+			default: break;
+		}
+	}
+
+	if (g->samples < 1) g->samples = 1;
+	if ((g->nmodes < 1)||(g->nintervals < 1)) {
+		fprintf(stdout,"Nothing to run\n");
+		exit(1);
+	}
+
+	return 0;
+}
+
+/*
+ * Start the simulator with one pty and the socket, and wait
+ * for both to appear
+ *
+ */
+int bench_start_sim( struct bench_glb *g ) {
+	char lat[16], jit[16], err[16], prefix[128];
+	uint64_t give_up;
+
+	snprintf(g->dir, sizeof(g->dir), "/tmp/mp7100-bench.XXXXXX");
+	if (!mkdtemp(g->dir)) return -1;
+	snprintf(prefix, sizeof(prefix), "%s/pty", g->dir);
+	snprintf(g->pty_link, sizeof(g->pty_link), "%s/pty0", g->dir);
+	snprintf(g->sock_path, sizeof(g->sock_path), "%s/usbtmc.sock", g->dir);
+	snprintf(lat, sizeof(lat), "%d", g->latency);
+	snprintf(jit, sizeof(jit), "%d", g->jitter);
+	snprintf(err, sizeof(err), "%f", g->error_rate);
+
+	g->sim_pid = fork();
+	if (g->sim_pid < 0) return -1;
+	if (g->sim_pid == 0) {
+		if (!freopen("/dev/null", "w", stdout)) _exit(1);
+		execl(g->sim_path, g->sim_path, "-q", "-n", "1", "-l", lat, "-j", jit, "-e", err, "-L", prefix, "-U", g->sock_path, (char *)NULL);
+		fprintf(stderr,"%s:%d: Unable to run %s (%s)\n", FL, g->sim_path, strerror(errno));
+		_exit(1);
+	}
+
+	give_up = monotonic_us() +BENCH_STARTUP_WAIT;
+	while (monotonic_us() < give_up) {
+		struct stat st;
+		if ((stat(g->pty_link, &st) == 0) && (stat(g->sock_path, &st) == 0)) return 0;
+		usleep(10000);
+	}
+
+	errno = ETIMEDOUT;
+	return -1;
+}
+
+void bench_stop_sim( struct bench_glb *g ) {
+	if (g->sim_pid > 0) {
+		kill(g->sim_pid, SIGTERM);
+		waitpid(g->sim_pid, NULL, 0);
+	}
+	rmdir(g->dir);
+}
+
+/*
+ * Connect to the simulator's socket as if it were a usbtmc
+ * node.  Not a character device, so usb_setup() treats it as
+ * pollable.
+ *
+ */
+int bench_open_usbtmc( struct bench_glb *g, struct device_s *d ) {
+	struct sockaddr_un sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", g->sock_path);
+
+	d->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (d->fd < 0) return -1;
+	if (connect(d->fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) return -1;
+	usb_setup(d);
+	rx_ring_reset(&(d->rx));
+
+	return 0;
+}
+
+static int cmp_u32( const void *a, const void *b ) {
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return (x > y) -(x < y);
+}
+
+static uint64_t cpu_us( void ) {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return (uint64_t)(ru.ru_utime.tv_sec +ru.ru_stime.tv_sec) *1000000
+		+ru.ru_utime.tv_usec +ru.ru_stime.tv_usec;
+}
+
+/*
+ * One run; samples are taken on an absolute schedule so the
+ * transaction time doesn't stretch the interval
+ *
+ */
+void bench_run( struct bench_glb *g, struct device_s *d, int interval, uint32_t *lat, struct bench_result_s *r ) {
+	char v[TXN_RESP_SIZE], a[TXN_RESP_SIZE];
+	uint64_t start, end, cpu, next;
+
+	r->samples = g->samples;
+	r->errors = 0;
+
+	cpu = cpu_us();
+	start = next = monotonic_us();
+	for (int k = 0; k < g->samples; k++) {
+		uint64_t t0, now;
+
+		now = monotonic_us();
+		if (now < next) usleep(next -now);
+		next += interval;
+
+		t0 = monotonic_us();
+		if (acquire(d, v, sizeof(v), a, sizeof(a)) != 0) {
+			r->errors++;
+			d->error_flag = false;
+		}
+		lat[k] = monotonic_us() -t0;
+	}
+	end = monotonic_us();
+	cpu = cpu_us() -cpu;
+
+	qsort(lat, g->samples, sizeof(uint32_t), cmp_u32);
+	r->rate = (double)g->samples *1000000.0 / (double)(end -start);
+	r->p50 = lat[g->samples /2];
+	r->p99 = lat[(g->samples *99) /100];
+	r->max = lat[g->samples -1];
+	r->cpu = (double)cpu / g->samples;
+}
+
+int main( int argc, char **argv ) {
+	struct bench_glb g;
+	uint32_t *lat;
+
+	bench_init(&g);
+	bench_parse_parameters(&g, argc, argv);
+	signal(SIGPIPE, SIG_IGN);
+
+	lat = (uint32_t *)malloc(g.samples *sizeof(uint32_t));
+	if (!lat) exit(1);
+
+	if (bench_start_sim(&g) != 0) {
+		fprintf(stderr,"%s:%d: Simulator didn't start (%s)\n", FL, strerror(errno));
+		bench_stop_sim(&g);
+		exit(1);
+	}
+
+	fprintf(stdout,"# latency %dus jitter %dus errors %.1f%%, %d samples per run\n", g.latency, g.jitter, g.error_rate, g.samples);
+	fprintf(stdout,"%-8s %-9s %8s %10s %8s %8s %8s %11s %6s\n"
+			, "# trans", "mode", "int(us)", "samples/s", "p50(us)", "p99(us)", "max(us)", "cpu/smp(us)", "errs");
+
+	for (int t = 0; t < 2; t++) {
+		struct device_s d;
+		char name[16];
+
+		if ((t == 0) && !g.serial) continue;
+		if ((t == 1) && !g.usbtmc) continue;
+
+		/*
+		 * The name picks the transport and its query framing
+		 * in device_init()
+		 *
+		 */
+		snprintf(name, sizeof(name), "%s", t?"usbtmc-sim":"serial-sim");
+		device_init(&d, 0, t?name:g.pty_link);
+		d.io_timeout = g.io_timeout;
+
+		if (t == 0) {
+			if (device_open(&d) != 0) continue;
+		} else if (bench_open_usbtmc(&g, &d) != 0) {
+			fprintf(stderr,"%s:%d: Unable to connect to %s (%s)\n", FL, g.sock_path, strerror(errno));
+			device_close(&d);
+			continue;
+		}
+
+		for (int m = 0; m < g.nmodes; m++) {
+			for (int i = 0; i < g.nintervals; i++) {
+				struct bench_result_s r;
+
+				d.acq_mode = g.modes[m];
+				d.interval = g.intervals[i];
+				bench_run(&g, &d, g.intervals[i], lat, &r);
+
+				fprintf(stdout,"%-8s %-9s %8d %10.0f %8u %8u %8u %11.1f %6d\n"
+						, t?"usbtmc":"serial"
+						, mode_names[g.modes[m]]
+						, g.intervals[i]
+						, r.rate, r.p50, r.p99, r.max, r.cpu, r.errors);
+				fflush(stdout);
+			}
+		}
+
+		device_close(&d);
+	}
+
+	bench_stop_sim(&g);
+	free(lat);
+
+	return 0;
+}
@@ -0,0 +1,708 @@
+/*
+ * Multicomp MP7100  / OWON SP3051 / 3101 / 6031 / 5051
+ *
+ * SCPI power supply simulator
+ *
+ * Creates one or more pseudo-terminals and answers the subset of
+ * SCPI the OSD (and most scripts) use, so mp7100 can be run and
+ * load tested without hardware:
+ *
+ *   ./mp7100-sim -n 4 -l 2000 -j 500
+ *   ./mp7100 -p /dev/pts/5
+ *
+ * With -U it also listens on a SOCK_SEQPACKET unix socket.
+ * Every connection there is another supply which, like a
+ * usbtmc node, talks in whole messages rather than a byte
+ * stream; it's what the benchmark uses in place of a real
+ * usbtmc device.
+ *
+ * Each instance models a supply with a resistive load: constant
+ * voltage until the load wants more than the current limit, then
+ * constant current.
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define FL __FILE__,__LINE__
+
+#ifndef BUILD_VER
+#define BUILD_VER 000
+#endif
+
+#ifndef BUILD_DATE
+#define BUILD_DATE " "
+#endif
+
+#define SIM_MAX_INSTANCES 256
+#define SIM_RX_SIZE 1024
+#define SIM_PENDING 32 // responses queued per instance
+#define SIM_RESP_SIZE 256
+
+#define SIM_IDN "OWON,SP3051,SIM%04d,FV:V1.0.0 (mp7100-sim)"
+
+/*
+ * A response waiting for its simulated latency to pass
+ *
+ */
+struct sim_pending_s {
+	uint64_t due;
+	int len;
+	char text[SIM_RESP_SIZE];
+};
+
+struct sim_psu_s {
+	int index;
+	int master; // -1 once a socket client has gone
+	int slave; // kept open so the master never sees a hangup
+	bool message_based; // socket client, one packet per message
+	char path[64];
+
+	char rx[SIM_RX_SIZE];
+	int rx_len;
+
+	struct sim_pending_s pending[SIM_PENDING];
+	int p_head, p_count;
+	uint64_t last_due;
+
+	double volts_set;
+	double amps_set;
+	bool output;
+	int last_error;
+
+	uint64_t queries;
+	uint64_t injected;
+};
+
+struct sim_glb {
+	int instances; // ptys to create
+	int count; // slots in use, ptys then socket clients
+	int latency; // us before each response
+	int jitter; // us, extra 0..jitter added to latency
+	double noise; // +/- added to each reading
+	double error_rate; // percent of responses to mangle
+	double volts, amps, load;
+	char *link_prefix;
+	char *socket_path;
+	uint8_t debug;
+	uint8_t quiet;
+
+	int epfd;
+	int timerfd;
+	int listenfd;
+	struct sim_psu_s *psu;
+};
+
+static volatile sig_atomic_t sim_quit = 0;
+
+static void sim_signal( int sig ) {
+	(void)sig;
+	sim_quit = 1;
+}
+
+static uint64_t monotonic_us( void ) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec *1000000 + ts.tv_nsec /1000;
+}
+
+/*
+ * Uniform random number in [0,1)
+ *
+ */
+static double sim_rand( void ) {
+	return (double)random() / ((double)RAND_MAX +1.0);
+}
+
+void sim_init( struct sim_glb *g ) {
+	g->instances = 1;
+	g->count = 0;
+	g->latency = 1000;
+	g->jitter = 0;
+	g->noise = 0.0;
+	g->error_rate = 0.0;
+	g->volts = 12.0;
+	g->amps = 1.0;
+	g->load = 24.0;
+	g->link_prefix = NULL;
+	g->socket_path = NULL;
+	g->debug = 0;
+	g->quiet = 0;
+	g->epfd = -1;
+	g->timerfd = -1;
+	g->listenfd = -1;
+	g->psu = NULL;
+}
+
+void sim_show_help( void ) {
+	fprintf(stdout,"MP7100 SCPI power supply simulator\r\n"
+			"Build %d / %s\r\n"
+			"\r\n"
+			"\t-h: This help\r\n"
+			"\t-d: debug enabled (log every query)\r\n"
+			"\t-q: quiet output\r\n"
+			"\t-n <instances> (number of simulated supplies, default 1)\r\n"
+			"\t-l <latency> (us before each response, default 1000)\r\n"
+			"\t-j <jitter> (up to this many us extra per response, default 0)\r\n"
+			"\t-N <noise> (+/- volts/amps added to readings, default 0)\r\n"
+			"\t-e <percent> (responses to drop or garble, default 0)\r\n"
+			"\t-V <volts> (initial voltage setpoint, default 12)\r\n"
+			"\t-A <amps> (initial current limit, default 1)\r\n"
+			"\t-R <ohms> (load resistance, default 24)\r\n"
+			"\t-L <prefix> (symlink each pty as <prefix>0, <prefix>1 ...)\r\n"
+			"\t-U <path> (also serve message based supplies on a unix socket)\r\n"
+			"\r\n"
+			"\texample: mp7100-sim -n 4 -l 2000 -j 500 -L /tmp/psu\r\n"
+			, BUILD_VER
+			, BUILD_DATE
+			);
+}
+
+int sim_parse_parameters( struct sim_glb *g, int argc, char **argv ) {
+	for (int i = 1; i < argc; i++) {
+		if (argv[i][0] != '-') continue;
+
+		/*
+		 * Everything but the flags takes a value
+		 *
+		 */
+		if ((strchr("hdq", argv[i][1]) == NULL) && (i +1 >= argc)) {
+			fprintf(stdout,"Insufficient parameters; %s needs a value\n", argv[i]);
+			exit(1);
+		}
+
+		switch (argv[i][1]) {
+			case 'h': sim_show_help(); exit(1); break;
+			case 'd': g->debug = 1; break;
+			case 'q': g->quiet = 1; break;
+			case 'n': g->instances = atoi(argv[++i]); break;
+			case 'l': g->latency = atoi(argv[++i]); break;
+			case 'j': g->jitter = atoi(argv[++i]); break;
+			case 'N': g->noise = atof(argv[++i]); break;
+			case 'e': g->error_rate = atof(argv[++i]); break;
+			case 'V': g->volts = atof(argv[++i]); break;
+			case 'A': g->amps = atof(argv[++i]); break;
+			case 'R': g->load = atof(argv[++i]); break;
+			case 'L': g->link_prefix = argv[++i]; break;
+			case 'U': g->socket_path = argv[++i]; break;
+			default: break;
+		}
+	}
+
+	if ((g->instances < 1)&&(!g->socket_path)) g->instances = 1;
+	if (g->instances < 0) g->instances = 0;
+	if (g->instances > SIM_MAX_INSTANCES) g->instances = SIM_MAX_INSTANCES;
+	if (g->latency < 0) g->latency = 0;
+	if (g->jitter < 0) g->jitter = 0;
+	if (g->load <= 0.0) g->load = 1e-3;
+
+	return 0;
+}
+
+/*
+ * Power on state
+ *
+ */
+void sim_reset( struct sim_glb *g, struct sim_psu_s *p ) {
+	p->volts_set = g->volts;
+	p->amps_set = g->amps;
+	p->output = true;
+	p->last_error = 0;
+	p->rx_len = 0;
+	p->p_head = p->p_count = 0;
+	p->last_due = 0;
+	p->queries = p->injected = 0;
+}
+
+/*
+ * Open a pty pair for one simulated supply
+ *
+ * Returns 0 on success, -1 with errno set
+ *
+ */
+int sim_open_pty( struct sim_glb *g, struct sim_psu_s *p ) {
+	struct termios tp;
+	char *name;
+
+	p->master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (p->master < 0) return -1;
+	if ((grantpt(p->master) != 0)||(unlockpt(p->master) != 0)) return -1;
+
+	name = ptsname(p->master);
+	if (!name) return -1;
+	snprintf(p->path, sizeof(p->path), "%s", name);
+
+	p->slave = open(p->path, O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (p->slave < 0) return -1;
+
+	/*
+	 * Raw from the start, otherwise queries written before the
+	 * client configures the port would be echoed back to it
+	 *
+	 */
+	tcgetattr(p->slave, &tp);
+	cfmakeraw(&tp);
+	tcsetattr(p->slave, TCSANOW, &tp);
+
+	fcntl(p->master, F_SETFL, fcntl(p->master, F_GETFL) | O_NONBLOCK);
+	p->message_based = false;
+	sim_reset(g, p);
+
+	return 0;
+}
+
+/*
+ * Take a connection on the -U socket as a new supply
+ *
+ * Returns the new slot or NULL
+ *
+ */
+struct sim_psu_s *sim_accept( struct sim_glb *g ) {
+	struct sim_psu_s *p;
+	int fd;
+
+	fd = accept4(g->listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) return NULL;
+
+	if (g->count >= SIM_MAX_INSTANCES) {
+		close(fd);
+		return NULL;
+	}
+
+	p = &(g->psu[g->count]);
+	p->index = g->count++;
+	p->master = fd;
+	p->slave = -1;
+	p->message_based = true;
+	snprintf(p->path, sizeof(p->path), "%s#%d", g->socket_path, p->index);
+	sim_reset(g, p);
+
+	return p;
+}
+
+/*
+ * What the simulated supply is putting out right now
+ *
+ */
+void sim_output( struct sim_glb *g, struct sim_psu_s *p, double *v, double *a ) {
+	if (!p->output) {
+		*v = *a = 0.0;
+	} else if (p->volts_set / g->load > p->amps_set) {
+		*a = p->amps_set; // CC
+		*v = p->amps_set * g->load;
+	} else {
+		*v = p->volts_set; // CV
+		*a = p->volts_set / g->load;
+	}
+
+	if (g->noise > 0.0) {
+		*v += (sim_rand() *2.0 -1.0) *g->noise;
+		*a += (sim_rand() *2.0 -1.0) *g->noise;
+		if (*v < 0.0) *v = 0.0;
+		if (*a < 0.0) *a = 0.0;
+	}
+}
+
+/*
+ * SCPI header matching, "MEASure:VOLTage?" accepts MEAS:VOLT?,
+ * MEASURE:VOLTAGE? and any mix, case insensitively.  The short
+ * form is the upper case letters, which always lead the
+ * mnemonic.
+ *
+ */
+bool scpi_match( const char *in, const char *pattern ) {
+	while (*pattern) {
+		const char *pe = pattern;
+		const char *ie = in;
+		int plen, ilen, shortlen = 0;
+		bool pq, iq;
+
+		while (*pe && (*pe != ':')) {
+			if (isupper((unsigned char)*pe)||(*pe == '*')) shortlen++;
+			pe++;
+		}
+		while (*ie && (*ie != ':')) ie++;
+
+		/*
+		 * The query mark isn't part of the mnemonic, compare
+		 * it separately
+		 *
+		 */
+		plen = pe -pattern;
+		ilen = ie -in;
+		pq = (plen && pattern[plen -1] == '?');
+		iq = (ilen && in[ilen -1] == '?');
+		if (pq != iq) return false;
+		if (pq) { plen--; ilen--; }
+
+		if ((ilen != plen)&&(ilen != shortlen)) return false;
+		if (strncasecmp(in, pattern, ilen)) return false;
+
+		pattern = *pe?pe +1:pe;
+		in = *ie?ie +1:ie;
+		if ((*pattern == '\0') != (*in == '\0')) return false;
+	}
+
+	return (*in == '\0');
+}
+
+/*
+ * Answer one SCPI command (no ';'), appending any response to
+ * out.  Returns true if the command produced a response.
+ *
+ */
+bool sim_command( struct sim_glb *g, struct sim_psu_s *p, char *cmd, char *out, size_t outsz ) {
+	char *arg;
+	double v, a;
+	size_t o = strlen(out);
+
+	while (isspace((unsigned char)*cmd)) cmd++;
+	arg = cmd;
+	while (*arg && !isspace((unsigned char)*arg)) arg++;
+	if (*arg) {
+		*arg++ = '\0';
+		while (isspace((unsigned char)*arg)) arg++;
+	}
+	if (*cmd == '\0') return false;
+	if (*cmd == ':') cmd++;
+
+	sim_output(g, p, &v, &a);
+
+#define SIM_REPLY(...) do { snprintf(out +o, outsz -o, "%s", o?";":""); o = strlen(out); snprintf(out +o, outsz -o, __VA_ARGS__); } while (0)
+
+	if (scpi_match(cmd, "*IDN?")) SIM_REPLY(SIM_IDN, p->index);
+	else if (scpi_match(cmd, "MEASure:VOLTage?")) SIM_REPLY("%.3f", v);
+	else if (scpi_match(cmd, "MEASure:CURRent?")) SIM_REPLY("%.3f", a);
+	else if (scpi_match(cmd, "MEASure:POWer?")) SIM_REPLY("%.3f", v *a);
+	else if (scpi_match(cmd, "MEASure:ALL?")) SIM_REPLY("%.3f,%.3f,%.3f", v, a, v *a);
+	else if (scpi_match(cmd, "VOLTage?")||scpi_match(cmd, "SOURce:VOLTage?")) SIM_REPLY("%.3f", p->volts_set);
+	else if (scpi_match(cmd, "CURRent?")||scpi_match(cmd, "SOURce:CURRent?")) SIM_REPLY("%.3f", p->amps_set);
+	else if (scpi_match(cmd, "OUTPut?")||scpi_match(cmd, "OUTPut:STATe?")) SIM_REPLY("%s", p->output?"ON":"OFF");
+	else if (scpi_match(cmd, "SYSTem:ERRor?")) {
+		SIM_REPLY("%d,\"%s\"", p->last_error, p->last_error?"Undefined header":"No error");
+		p->last_error = 0;
+	}
+	else if (scpi_match(cmd, "VOLTage")||scpi_match(cmd, "SOURce:VOLTage")) {
+		if (*arg) p->volts_set = atof(arg);
+		return false;
+	}
+	else if (scpi_match(cmd, "CURRent")||scpi_match(cmd, "SOURce:CURRent")) {
+		if (*arg) p->amps_set = atof(arg);
+		return false;
+	}
+	else if (scpi_match(cmd, "OUTPut")||scpi_match(cmd, "OUTPut:STATe")) {
+		p->output = ((strcasecmp(arg, "ON") == 0)||(strcmp(arg, "1") == 0));
+		return false;
+	}
+	else if (scpi_match(cmd, "*RST")) {
+		p->volts_set = g->volts;
+		p->amps_set = g->amps;
+		p->output = true;
+		return false;
+	}
+	else if (scpi_match(cmd, "*CLS")) {
+		p->last_error = 0;
+		return false;
+	}
+	else {
+		p->last_error = -113;
+		return false;
+	}
+
+#undef SIM_REPLY
+
+	return true;
+}
+
+/*
+ * Queue a response to go out once its latency has passed,
+ * keeping them in order even with jitter
+ *
+ */
+void sim_queue( struct sim_glb *g, struct sim_psu_s *p, const char *text ) {
+	struct sim_pending_s *r;
+	uint64_t due;
+
+	if (p->p_count >= SIM_PENDING) return; // client isn't reading, drop it
+
+	due = monotonic_us() +g->latency;
+	if (g->jitter) due += (uint64_t)(sim_rand() *g->jitter);
+	if (due < p->last_due) due = p->last_due;
+	p->last_due = due;
+
+	r = &(p->pending[(p->p_head +p->p_count) % SIM_PENDING]);
+	r->due = due;
+	r->len = snprintf(r->text, sizeof(r->text), "%s\n", text);
+	if (r->len >= (int)sizeof(r->text)) r->len = sizeof(r->text) -1;
+	p->p_count++;
+}
+
+/*
+ * Handle a full line from the client
+ *
+ */
+void sim_line( struct sim_glb *g, struct sim_psu_s *p, char *line ) {
+	char out[SIM_RESP_SIZE];
+	char *save = NULL;
+	char *cmd;
+	bool any = false;
+
+	if (g->debug) fprintf(stdout,"%s: << %s\n", p->path, line);
+	p->queries++;
+	out[0] = '\0';
+
+	for (cmd = strtok_r(line, ";", &save); cmd; cmd = strtok_r(NULL, ";", &save)) {
+		if (sim_command(g, p, cmd, out, sizeof(out))) any = true;
+	}
+	if (!any) return;
+
+	/*
+	 * Error injection, split evenly between a lost response,
+	 * garbage and a truncated response
+	 *
+	 */
+	if ((g->error_rate > 0.0) && (sim_rand() *100.0 < g->error_rate)) {
+		double k = sim_rand();
+
+		p->injected++;
+		if (k < 0.333) {
+			if (g->debug) fprintf(stdout,"%s: dropping response\n", p->path);
+			return;
+		} else if (k < 0.666) {
+			snprintf(out, sizeof(out), "#%c!%c", 'A' +(int)(sim_rand() *26), 'a' +(int)(sim_rand() *26));
+		} else {
+			out[strlen(out) /2] = '\0';
+		}
+	}
+
+	if (g->debug) fprintf(stdout,"%s: >> %s\n", p->path, out);
+	sim_queue(g, p, out);
+}
+
+/*
+ * Pull what the client sent and act on any complete lines
+ *
+ */
+void sim_read( struct sim_glb *g, struct sim_psu_s *p ) {
+	ssize_t sz;
+	int start = 0;
+
+	sz = read(p->master, p->rx +p->rx_len, sizeof(p->rx) -1 -p->rx_len);
+	if ((sz == 0) && p->message_based) {
+		close(p->master);
+		p->master = -1;
+		return;
+	}
+	if (sz <= 0) return;
+	p->rx_len += sz;
+
+	/*
+	 * A packet is a whole message, terminated or not
+	 *
+	 */
+	if (p->message_based && (p->rx[p->rx_len -1] != '\n')) {
+		p->rx[p->rx_len++] = '\n';
+	}
+
+	for (int i = 0; i < p->rx_len; i++) {
+		if ((p->rx[i] == '\n')||(p->rx[i] == '\r')) {
+			p->rx[i] = '\0';
+			if (i > start) sim_line(g, p, p->rx +start);
+			start = i +1;
+		}
+	}
+
+	memmove(p->rx, p->rx +start, p->rx_len -start);
+	p->rx_len -= start;
+	if (p->rx_len >= (int)sizeof(p->rx) -1) p->rx_len = 0; // no terminator in sight, junk it
+}
+
+/*
+ * Send every response that's due, returns when the next one
+ * will be (0 if none are waiting)
+ *
+ */
+uint64_t sim_flush( struct sim_glb *g, uint64_t now ) {
+	uint64_t next = 0;
+
+	for (int i = 0; i < g->count; i++) {
+		struct sim_psu_s *p = &(g->psu[i]);
+
+		if (p->master < 0) continue;
+		while (p->p_count) {
+			struct sim_pending_s *r = &(p->pending[p->p_head]);
+
+			if (r->due > now) {
+				if ((next == 0)||(r->due < next)) next = r->due;
+				break;
+			}
+			if (write(p->master, r->text, r->len) < 0) {
+				if (errno == EAGAIN) break;
+			}
+			p->p_head = (p->p_head +1) % SIM_PENDING;
+			p->p_count--;
+		}
+	}
+
+	return next;
+}
+
+/*
+ * Arm the timer for the next response due, 0 disarms it
+ *
+ */
+void sim_arm( struct sim_glb *g, uint64_t due ) {
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	if (due) {
+		its.it_value.tv_sec = due /1000000;
+		its.it_value.tv_nsec = (due %1000000) *1000;
+	}
+	timerfd_settime(g->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+int main( int argc, char **argv ) {
+	struct sim_glb g;
+	struct epoll_event ev;
+
+	sim_init(&g);
+	sim_parse_parameters(&g, argc, argv);
+	srandom(monotonic_us());
+
+	signal(SIGINT, sim_signal);
+	signal(SIGTERM, sim_signal);
+	signal(SIGPIPE, SIG_IGN);
+
+	g.psu = (struct sim_psu_s *)calloc(SIM_MAX_INSTANCES, sizeof(struct sim_psu_s));
+	g.epfd = epoll_create1(EPOLL_CLOEXEC);
+	g.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if ((!g.psu)||(g.epfd < 0)||(g.timerfd < 0)) {
+		fprintf(stderr,"%s:%d: Unable to set up (%s)\n", FL, strerror(errno));
+		exit(1);
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(g.epfd, EPOLL_CTL_ADD, g.timerfd, &ev);
+
+	for (int i = 0; i < g.instances; i++) {
+		struct sim_psu_s *p = &(g.psu[i]);
+
+		p->index = g.count++;
+		if (sim_open_pty(&g, p) != 0) {
+			fprintf(stderr,"%s:%d: Unable to create pty (%s)\n", FL, strerror(errno));
+			exit(1);
+		}
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = p;
+		epoll_ctl(g.epfd, EPOLL_CTL_ADD, p->master, &ev);
+
+		if (g.link_prefix) {
+			char ln[4096];
+			snprintf(ln, sizeof(ln), "%s%d", g.link_prefix, i);
+			unlink(ln);
+			if (symlink(p->path, ln) != 0) {
+				fprintf(stderr,"%s:%d: Unable to link %s (%s)\n", FL, ln, strerror(errno));
+			}
+		}
+
+		fprintf(stdout,"%s\n", p->path);
+	}
+
+	if (g.socket_path) {
+		struct sockaddr_un sa;
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sun_family = AF_UNIX;
+		snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", g.socket_path);
+		unlink(g.socket_path);
+
+		g.listenfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if ((g.listenfd < 0)
+				||(bind(g.listenfd, (struct sockaddr *)&sa, sizeof(sa)) != 0)
+				||(listen(g.listenfd, 16) != 0)) {
+			fprintf(stderr,"%s:%d: Unable to listen on %s (%s)\n", FL, g.socket_path, strerror(errno));
+			exit(1);
+		}
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = &g;
+		epoll_ctl(g.epfd, EPOLL_CTL_ADD, g.listenfd, &ev);
+		fprintf(stdout,"%s\n", g.socket_path);
+	}
+	fflush(stdout);
+
+	while (!sim_quit) {
+		struct epoll_event evs[64];
+		uint64_t next;
+		int n;
+
+		n = epoll_wait(g.epfd, evs, 64, -1);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+
+		for (int i = 0; i < n; i++) {
+			if (evs[i].data.ptr == NULL) {
+				uint64_t expirations;
+				if (read(g.timerfd, &expirations, sizeof(expirations)) < 0) {};
+			} else if (evs[i].data.ptr == &g) {
+				struct sim_psu_s *p = sim_accept(&g);
+				if (p) {
+					ev.events = EPOLLIN;
+					ev.data.ptr = p;
+					epoll_ctl(g.epfd, EPOLL_CTL_ADD, p->master, &ev);
+				}
+			} else {
+				sim_read(&g, (struct sim_psu_s *)evs[i].data.ptr);
+			}
+		}
+
+		next = sim_flush(&g, monotonic_us());
+		sim_arm(&g, next);
+	}
+
+	for (int i = 0; i < g.count; i++) {
+		struct sim_psu_s *p = &(g.psu[i]);
+
+		if (!g.quiet) {
+			fprintf(stderr,"%s: %llu queries, %llu errors injected\n", p->path
+					, (unsigned long long)p->queries
+					, (unsigned long long)p->injected
+					);
+		}
+		if (g.link_prefix && !p->message_based) {
+			char ln[4096];
+			snprintf(ln, sizeof(ln), "%s%d", g.link_prefix, i);
+			unlink(ln);
+		}
+		if (p->master >= 0) close(p->master);
+		if (p->slave >= 0) close(p->slave);
+	}
+	if (g.listenfd >= 0) {
+		close(g.listenfd);
+		unlink(g.socket_path);
+	}
+	free(g.psu);
+
+	return 0;
+}
@@ -8,8 +8,10 @@
  *
  */
 
+#ifndef HEADLESS_ONLY
 #include <SDL.h>
 #include <SDL_ttf.h>
+#endif
 
 #include <signal.h>
 #include <stdint.h>
@@ -23,8 +25,25 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
-
-#define FL __FILE__,__LINE__
+#include <time.h>
+#include <pthread.h>
+#include <atomic>
+
+#include "sample.h"
+#include "perf.h"
+#include "fixed.h"
+#include "stats.h"
+#include "trend.h"
+#include "logger.h"
+#include "publisher.h"
+#include "shm.h"
+#include "transport.h"
+#include "engine.h"
+#include "models.h"
+#include "capture.h"
+#include "replay.h"
+#include "control.h"
+#include "ramp.h"
 
 /*
  * Should be defined in the Makefile to pass to the compiler from
@@ -56,48 +75,113 @@
 
 #define MMFLAG_AUTORANGE	0b01000000
 
-#define CMODE_USB 1
-#define CMODE_SERIAL 2
-#define CMODE_NONE 0
+#define MAX_FPS_DEFAULT 50 // display refresh cap, independent of -t
 
-#define MEAS_VOLT "MEAS:VOLT?"
-#define MEAS_CURR "MEAS:CURR?"
+#define MAX_DEVICES 64
 
-char SEPARATOR_DP[] = ".";
+#define READOUT_WIDTH 7
 
-struct serial_params_s {
-	char *device;
-	int fd, n;
-	int cnt, size, s_cnt;
-	struct termios oldtp, newtp;
-};
+#define PERF_HUD_REFRESH 500000 // us between HUD updates
+#define STATS_REFRESH 250000 // us between statistics line updates
+#define STATS_LINES 3
 
+#define TREND_MIN_RANGE 10000 // uV/uA, smallest span the chart zooms to
+
+#define KEY_VOLT_STEP 100000 // uV per up/down, ten times that with shift
+#define KEY_CURR_STEP 10000 // uA per right/left, ten times that with shift
+
+char SEPARATOR_DP[] = ".";
 
 struct glb {
 	uint8_t debug;
 	uint8_t quiet;
 	uint16_t flags;
-	uint16_t error_flag;
 	char *output_file;
-	char *device;
 
-	char meas_volt[20];
-	char meas_curr[20];
+	char *log_file;
+	int log_fsync; // ms between fdatasync()s, 0 = never
+	struct logger_s logger;
+
+	char *socket_path;
+	struct publisher_s publisher;
 
-	int usb_fhandle;
+	char *shm_name;
+	struct shm_writer_s shm;
 
-	int comms_mode;
-	char *com_address;
+	char *capture_file; // -r
+	struct capture_s capture;
+	char *replay_file; // -R / -RF
+	bool replay_fast;
+	struct replay_s replay;
+	int replays_done; // devices whose capture has played out
+
+	char *control_path; // -C
+	struct control_s control;
+	int control_dev; // device the keys change, picked with 1..9
+
+	char *ramp_file; // -x
+	struct ramp_s ramp;
+
+	/*
+	 * Defaults handed to every device
+	 *
+	 */
+	int acq_mode;
+	bool acq_mode_set; // -a given, otherwise each device gets its profile's
+	int io_timeout; // ms
+	int keepalive; // us, adaptive sampling when non-zero
+	double adapt_dv, adapt_di; // V/s, A/s
 	char *serial_parameters_string; // this is the raw from the command line
-	struct serial_params_s serial_params; // this is the decoded version
 
+	/*
+	 * Every -p given, each gets its own device_s and they're
+	 * all driven by the one engine on the acquisition thread
+	 *
+	 */
+	char *device_paths[MAX_DEVICES];
+	int ndev;
+	struct device_s *devices;
+	struct engine_s engine;
+
+	std::atomic<bool> quit;
+	bool headless;
 
 	int interval;
+	bool interval_set; // -t given, otherwise headless runs flat out
+	int max_fps;
+	bool perf_hud;
+	bool show_stats;
+	int trend_span; // seconds of history in the chart, 0 = no chart
+	struct perf_hist_s render; // us per redraw, render loop only
 	int font_size;
 	int window_width, window_height;
 	int wx_forced, wy_forced;
+#ifndef HEADLESS_ONLY
 	SDL_Color font_color_volts, font_color_amps, background_color;
+#endif
+};
+
+#ifndef HEADLESS_ONLY
+/*
+ * Pre-rendered glyphs for the main readout
+ *
+ * The readout only ever needs a handful of characters, so
+ * we render each of them once per colour in to a single
+ * texture and then draw lines by copying rects out of it.
+ * Row n of the atlas holds the glyphs in colour n.
+ *
+ */
+#define ATLAS_GLYPHS "0123456789.-+ VA"
+#define ATLAS_MAX_ROWS 4
+
+struct glyph_atlas_s {
+	SDL_Texture *texture;
+	int height; // row height, same as TTF_FontHeight()
+	int rows;
+	int8_t index[256]; // char to glyph slot, -1 if not in the atlas
+	SDL_Rect glyph[sizeof(ATLAS_GLYPHS) -1]; // slot rects in row 0
 };
+#endif
 
 /*
  * A whole bunch of globals, because I need
@@ -120,31 +204,6 @@ bool fileExists(const char *filename) {
 	return (stat(filename, &buf) == 0);
 }
 
-
-char digit( unsigned char dg ) {
-
-	int d;
-	char g;
-
-	switch (dg) {
-		case 0x30: g = '0'; d = 0; break;
-		case 0x31: g = '1'; d = 1; break;
-		case 0x32: g = '2'; d = 2; break;
-		case 0x33: g = '3'; d = 3; break;
-		case 0x34: g = '4'; d = 4; break;
-		case 0x35: g = '5'; d = 5; break;
-		case 0x36: g = '6'; d = 6; break;
-		case 0x37: g = '7'; d = 7; break;
-		case 0x38: g = '8'; d = 8; break;
-		case 0x39: g = '9'; d = 9; break;
-		case 0x3E: g = 'L'; d = 0; break;
-		case 0x3F: g = ' '; d = 0; break;
-		default: g = ' ';
-	}
-
-	return g;
-}
-
 /*-----------------------------------------------------------------\
   Date Code:	: 20180127-220248
   Function Name	: init
@@ -165,11 +224,44 @@ int init(struct glb *g) {
 	g->debug = 0;
 	g->quiet = 0;
 	g->flags = 0;
-	g->error_flag = 0;
 	g->output_file = NULL;
+	g->log_file = NULL;
+	g->log_fsync = 0;
+	g->logger.fd = -1;
+	g->socket_path = NULL;
+	g->publisher.fd = -1;
+	g->shm_name = NULL;
+	g->shm.shm = NULL;
+	g->capture_file = NULL;
+	g->capture.fd = -1;
+	g->replay_file = NULL;
+	g->replay_fast = false;
+	g->replays_done = 0;
+	g->control_path = NULL;
+	g->control.efd = -1;
+	g->control_dev = 0;
+	g->ramp_file = NULL;
 	g->interval = 100000;
-	g->device = NULL;
-	g->comms_mode = CMODE_NONE;
+	g->interval_set = false;
+	g->acq_mode = ACQ_COMPOUND;
+	g->acq_mode_set = false;
+	g->io_timeout = IO_TIMEOUT_DEFAULT;
+	g->keepalive = 0;
+	g->adapt_dv = ADAPT_DV_DEFAULT;
+	g->adapt_di = ADAPT_DI_DEFAULT;
+	g->ndev = 0;
+	g->devices = NULL;
+	g->quit = false;
+#ifdef HEADLESS_ONLY
+	g->headless = true;
+#else
+	g->headless = false;
+#endif
+	g->max_fps = MAX_FPS_DEFAULT;
+	g->perf_hud = false;
+	g->show_stats = false;
+	g->trend_span = 0;
+	perf_hist_reset(&(g->render));
 
 	g->serial_parameters_string = NULL;
 
@@ -179,9 +271,11 @@ int init(struct glb *g) {
 	g->wx_forced = 0;
 	g->wy_forced = 0;
 
+#ifndef HEADLESS_ONLY
 	g->font_color_volts =  { 10, 200, 10 };
 	g->font_color_amps =  { 200, 200, 10 };
 	g->background_color = { 0, 0, 0 };
+#endif
 
 	return 0;
 }
@@ -201,10 +295,34 @@ void show_help(void) {
 			"\t-cv <volts colour, a0a0ff>\r\n"
 			"\t-ca <amps colour, ffffa0>\r\n"
 			"\t-cb <background colour, 101010>\r\n"
-			"\t-t <interval> (sleep delay between samples, default 100,000us)\r\n"
+			"\t-t <interval> (us between samples, default 100,000us)\r\n"
+			"\t-a <legacy|pipeline|compound|all> (acquisition mode, default the fastest the model supports)\r\n"
+			"\t-T <timeout> (deadline per device transaction, default 1000ms)\r\n"
+			"\t-k <keep-alive> (adaptive: flat out while changing, else every <keep-alive>us)\r\n"
+			"\t-kv <V/s> (adaptive: voltage slew counted as changing, default 1.0)\r\n"
+			"\t-ka <A/s> (adaptive: current slew counted as changing, default 0.1)\r\n"
+			"\t-F <fps> (maximum display refresh rate, default 50)\r\n"
+			"\t-P: show the performance HUD, summary on exit\r\n"
+			"\t-E: show min/max/mean/RMS, Wh and Ah under each readout ('r' resets)\r\n"
+			"\t-g <seconds> (show a trend chart of the last <seconds>, eg 86400 for a day)\r\n"
+			"\t-H: headless, no window; samples go to stdout as CSV (or to -l)\r\n"
+			"\t    and are taken back to back unless -t is given\r\n"
+			"\t-l <log file> (append every sample, CSV)\r\n"
+			"\t-lf <ms> (fdatasync the log at most every <ms>, default never)\r\n"
+			"\t-S <socket path> (stream every sample, CSV, to anyone connecting)\r\n"
+			"\t-m <shm name> (keep the latest reading in shared memory, eg /mp7100, see shm.h)\r\n"
+			"\t-r <capture file> (record every byte to and from the supplies)\r\n"
+			"\t-R <capture file> (replay a capture at real speed in place of -p)\r\n"
+			"\t-RF <capture file> (replay a capture as fast as possible)\r\n"
+			"\t-C <socket path> (take VOLT / CURR / OUTP commands, see control.cpp)\r\n"
+			"\t-x <profile file> (run a timed setpoint profile, see ramp.cpp)\r\n"
 			"\t-p <comport>: Set the com port for the meter, eg: -p /dev/ttyUSB0\r\n"
+			"\t              (repeat -p to monitor several supplies from one window)\r\n"
 			"\t-s <[9600|4800|2400|1200]:[7|8][o|e|n][1|2]>, eg: -s 2400:8n1\r\n"
 			"\r\n"
+			"\tkeys: up/down volts, right/left amps (shift for bigger steps),\r\n"
+			"\t      o output on/off, 1-9 pick the supply they apply to, q quit\r\n"
+			"\r\n"
 			"\texample: MP7100 -p /dev/usbtmc2\r\n"
 			, BUILD_VER
 			, BUILD_DATE 
@@ -265,7 +383,11 @@ int parse_parameters(struct glb *g, int argc, char **argv ) {
 					 */
 					i++;
 					if (i < argc) {
-						g->device = argv[i];
+						if (g->ndev >= MAX_DEVICES) {
+							fprintf(stdout,"Too many devices, at most %d\n", MAX_DEVICES);
+							exit(1);
+						}
+						g->device_paths[g->ndev++] = argv[i];
 					} else {
 						fprintf(stdout,"Insufficient parameters; -p <usb TMC port ie, /dev/usbtmc2>\n");
 						exit(1);
@@ -299,10 +421,11 @@ int parse_parameters(struct glb *g, int argc, char **argv ) {
 				case 't':
 							 i++;
 							 g->interval = atoi(argv[i]);
+							 g->interval_set = true;
 							 break;
 
+#ifndef HEADLESS_ONLY
 				case 'c':
-							 int a,b,c;
 							 if (argv[i][2] == 'v') {
 								 i++;
 								 sscanf(argv[i], "%2hhx%2hhx%2hhx"
@@ -329,6 +452,7 @@ int parse_parameters(struct glb *g, int argc, char **argv ) {
 
 							 }
 							 break;
+#endif
 
 				case 'w':
 							 if (argv[i][2] == 'x') {
@@ -345,6 +469,154 @@ int parse_parameters(struct glb *g, int argc, char **argv ) {
 							 g->serial_parameters_string = argv[i];
 							 break;
 
+				case 'r':
+							 i++;
+							 if (i < argc) {
+								 g->capture_file = argv[i];
+							 } else {
+								 fprintf(stdout,"Insufficient parameters; -r <capture file>\n");
+								 exit(1);
+							 }
+							 break;
+
+				case 'R':
+							 i++;
+							 if (i < argc) {
+								 g->replay_file = argv[i];
+								 g->replay_fast = (argv[i-1][2] == 'F');
+							 } else {
+								 fprintf(stdout,"Insufficient parameters; -R <capture file> | -RF <capture file>\n");
+								 exit(1);
+							 }
+							 break;
+
+				case 'C':
+							 i++;
+							 if (i < argc) {
+								 g->control_path = argv[i];
+							 } else {
+								 fprintf(stdout,"Insufficient parameters; -C <socket path>\n");
+								 exit(1);
+							 }
+							 break;
+
+				case 'x':
+							 i++;
+							 if (i < argc) {
+								 g->ramp_file = argv[i];
+							 } else {
+								 fprintf(stdout,"Insufficient parameters; -x <profile file>\n");
+								 exit(1);
+							 }
+							 break;
+
+				case 'l':
+							 i++;
+							 if (i >= argc) {
+								 fprintf(stdout,"Insufficient parameters; -l <log file> | -lf <fsync interval ms>\n");
+								 exit(1);
+							 }
+							 if (argv[i-1][2] == 'f') {
+								 g->log_fsync = atoi(argv[i]);
+							 } else {
+								 g->log_file = argv[i];
+							 }
+							 break;
+
+				case 'S':
+							 i++;
+							 if (i < argc) {
+								 g->socket_path = argv[i];
+							 } else {
+								 fprintf(stdout,"Insufficient parameters; -S <socket path>\n");
+								 exit(1);
+							 }
+							 break;
+
+				case 'm':
+							 i++;
+							 if (i < argc) {
+								 g->shm_name = argv[i];
+							 } else {
+								 fprintf(stdout,"Insufficient parameters; -m <shared memory name>\n");
+								 exit(1);
+							 }
+							 break;
+
+				case 'F':
+							 i++;
+							 if (i < argc) {
+								 g->max_fps = atoi(argv[i]);
+								 if (g->max_fps < 1) g->max_fps = 1;
+								 if (g->max_fps > 1000) g->max_fps = 1000;
+							 } else {
+								 fprintf(stdout,"Insufficient parameters; -F <max fps>\n");
+								 exit(1);
+							 }
+							 break;
+
+				case 'P': g->perf_hud = true; break;
+
+				case 'H': g->headless = true; break;
+
+				case 'E': g->show_stats = true; break;
+
+				case 'g':
+							 i++;
+							 if (i < argc) {
+								 g->trend_span = atoi(argv[i]);
+								 if (g->trend_span < 0) g->trend_span = 0;
+							 } else {
+								 fprintf(stdout,"Insufficient parameters; -g <seconds of history>\n");
+								 exit(1);
+							 }
+							 break;
+
+				case 'k':
+							 i++;
+							 if (i >= argc) {
+								 fprintf(stdout,"Insufficient parameters; -k <keep-alive us> | -kv <V/s> | -ka <A/s>\n");
+								 exit(1);
+							 }
+							 if (argv[i-1][2] == 'v') {
+								 g->adapt_dv = atof(argv[i]);
+							 } else if (argv[i-1][2] == 'a') {
+								 g->adapt_di = atof(argv[i]);
+							 } else {
+								 g->keepalive = atoi(argv[i]);
+								 if (g->keepalive < 0) g->keepalive = 0;
+							 }
+							 break;
+
+				case 'T':
+							 i++;
+							 if (i < argc) {
+								 g->io_timeout = atoi(argv[i]);
+								 if (g->io_timeout < 1) g->io_timeout = 1;
+							 } else {
+								 fprintf(stdout,"Insufficient parameters; -T <timeout ms>\n");
+								 exit(1);
+							 }
+							 break;
+
+				case 'a':
+							 i++;
+							 if (i < argc) {
+								 if (strcmp(argv[i], "legacy") == 0) g->acq_mode = ACQ_LEGACY;
+								 else if (strcmp(argv[i], "pipeline") == 0) g->acq_mode = ACQ_PIPELINE;
+								 else if (strcmp(argv[i], "compound") == 0) g->acq_mode = ACQ_COMPOUND;
+								 else if (strcmp(argv[i], "all") == 0) g->acq_mode = ACQ_ALL;
+								 else {
+									 fprintf(stdout,"Unknown acquisition mode '%s'\n", argv[i]);
+									 exit(1);
+								 }
+								 g->acq_mode_set = true;
+							 } else {
+								 fprintf(stdout,"Insufficient parameters; -a <legacy|pipeline|compound|all>\n");
+								 exit(1);
+							 }
+							 break;
+
 				default: break;
 			} // switch
 		}
@@ -353,169 +625,429 @@ int parse_parameters(struct glb *g, int argc, char **argv ) {
 	return 0;
 }
 
+/*
+ * Called by the engine for every finished transaction, on
+ * the acquisition thread
+ *
+ */
+void acq_publish( void *arg, struct device_s *d, struct sample_s *smp ) {
+	struct glb *g = (struct glb *)arg;
+
+	/*
+	 * A replayed device going offline just means its capture
+	 * has played out, that isn't part of what was recorded.
+	 * Headless, the replay ends once they all have.
+	 *
+	 */
+	if (d->replay && (smp->flags & SAMPLE_OFFLINE)) {
+		if ((++g->replays_done == g->ndev) && g->headless) g->quit = true;
+		return;
+	}
+
+	/*
+	 * Headless, a profile run ends with the profile, once its
+	 * last changes have gone out
+	 *
+	 */
+	if (g->ramp_file) {
+		ramp_sample(&(g->ramp), smp);
+		if (g->ramp.done && g->headless && (g->devices[g->ramp.dev].npending == 0)) g->quit = true;
+	}
+
+	if (g->logger.fd >= 0) logger_sample(&(g->logger), smp);
+	if (g->publisher.fd >= 0) publisher_sample(&(g->publisher), smp);
+	if (g->shm.shm) shm_writer_sample(&(g->shm), smp);
+	if (g->headless) return;
+	if (!sample_ring_push(&(d->ring), smp)) d->ring_drops++;
+}
+
+/*
+ * Engine idle hook, keeps the log flushed while samples
+ * aren't arriving
+ *
+ */
+void acq_idle( void *arg ) {
+	struct glb *g = (struct glb *)arg;
+
+	if (g->logger.fd >= 0) logger_tick(&(g->logger), monotonic_us());
+}
+
+void headless_signal( int sig ) {
+	(void)sig;
+	glbs->quit = true;
+}
+
+/*
+ * No window: the engine runs right here until we're told to
+ * stop, every sample goes straight to the logger
+ *
+ */
+void run_headless( struct glb *g ) {
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = headless_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
 
+	engine_run(&(g->engine), &(g->quit));
+}
 
 /*
- * Default parameters are 2400:8n1, given that the multimeter
- * is shipped like this and cannot be changed then we shouldn't
- * have to worry about needing to make changes, but we'll probably
- * add that for future changes.
+ * Acquisition thread
+ *
+ * Owns the device handles, everything it learns goes out
+ * through each device's ring, so a slow device never stalls
+ * the window and a slow render never delays the next sample.
  *
  */
-void open_port( struct glb *g ) {
-#ifdef __linux__
-	struct serial_params_s *s = &(g->serial_params);
-	char *p = g->serial_parameters_string;
-	char default_params[] = "9600:8:n";
-	int r; 
-
-	if (!p) p = default_params;
-
-	fprintf(stdout,"Attempting to open '%s'\n", s->device);
-	s->fd = open( s->device, O_RDWR | O_NOCTTY | O_NDELAY );
-	if (s->fd <0) {
-		perror( s->device );
-	}
-
-	fcntl(s->fd,F_SETFL,0);
-	tcgetattr(s->fd,&(s->oldtp)); // save current serial port settings 
-	tcgetattr(s->fd,&(s->newtp)); // save current serial port settings in to what will be our new settings
-	cfmakeraw(&(s->newtp));
-	
-		s->newtp.c_cflag = CS8 |  CLOCAL | CREAD ; 
-
-      if (strncmp(p, "115200:", 7) == 0) s->newtp.c_cflag |= B115200; 
-		else if (strncmp(p, "57600:", 6) == 0) s->newtp.c_cflag |= B57600;
-		else if (strncmp(p, "38400:", 6) == 0) s->newtp.c_cflag |= B38400;
-		else if (strncmp(p, "19200:", 6) == 0) s->newtp.c_cflag |= B19200;
-		else if (strncmp(p, "9600:", 5) == 0) s->newtp.c_cflag |= B9600;
-		else if (strncmp(p, "4800:", 5) == 0) s->newtp.c_cflag |= B4800;
-      else if (strncmp(p, "2400:", 5) == 0) s->newtp.c_cflag |= B2400; //
-      else {
-         fprintf(stdout,"Invalid serial speed\r\n");
-         exit(1);
-      }
+void *acquisition_thread( void *arg ) {
+	struct glb *g = (struct glb *)arg;
 
-		p = strchr(p,':');
-		if (p) {
-			p++;
-			// we don't do anything with the data bits because
-			// this PSU only accepts 8, so just jump to the next
-			// field
-			p = strchr(p,':');
-			if (!p) {
-				fprintf(stdout,"Invalid serial format string\n");
-				exit(1);
+	engine_run(&(g->engine), &(g->quit));
+
+	return NULL;
+}
+
+#ifndef HEADLESS_ONLY
+/*
+ * Render ATLAS_GLYPHS in each of the colours in to one
+ * texture.
+ *
+ * Returns 0 on success, -1 if SDL/TTF couldn't oblige, in
+ * which case callers just keep rendering text the slow way.
+ *
+ */
+int atlas_build( struct glyph_atlas_s *a, SDL_Renderer *renderer, TTF_Font *font, SDL_Color *colours, int ncolours ) {
+	const char *glyphs = ATLAS_GLYPHS;
+	int n = strlen(glyphs);
+	int width = 0;
+	SDL_Surface *atlas;
+
+	a->texture = NULL;
+	a->rows = 0;
+	memset(a->index, -1, sizeof(a->index));
+	if ((ncolours < 1)||(ncolours > ATLAS_MAX_ROWS)) return -1;
+
+	a->height = TTF_FontHeight(font);
+	for (int i = 0; i < n; i++) {
+		char c[2] = { glyphs[i], '\0' };
+		int w, h;
+
+		if (TTF_SizeUTF8(font, c, &w, &h)) return -1;
+		a->glyph[i] = { width, 0, w, a->height };
+		a->index[(uint8_t)glyphs[i]] = i;
+		width += w;
+	}
+
+	atlas = SDL_CreateRGBSurfaceWithFormat(0, width, a->height *ncolours, 32, SDL_PIXELFORMAT_RGBA32);
+	if (!atlas) return -1;
+
+	for (int row = 0; row < ncolours; row++) {
+		for (int i = 0; i < n; i++) {
+			char c[2] = { glyphs[i], '\0' };
+			SDL_Surface *gs;
+			SDL_Rect dst = a->glyph[i];
+
+			if (glyphs[i] == ' ') continue;
+			gs = TTF_RenderUTF8_Solid(font, c, colours[row]);
+			if (!gs) {
+				SDL_FreeSurface(atlas);
+				return -1;
 			}
-      }
+			dst.y = row *a->height;
+			SDL_BlitSurface(gs, NULL, atlas, &dst);
+			SDL_FreeSurface(gs);
+		}
+	}
 
-      p++;
-      if (*p == 'o') s->newtp.c_cflag |= PARODD;
-      else if (*p == 'e') s->newtp.c_cflag |= PARENB;
-      else if (*p == 'n') s->newtp.c_cflag &= ~(PARODD|PARENB);
-      else {
-         fprintf(stdout,"Invalid serial parity type '%c'\r\n", *p);
-         exit(1);
-      }
+	a->texture = SDL_CreateTextureFromSurface(renderer, atlas);
+	SDL_FreeSurface(atlas);
+	if (!a->texture) return -1;
+	a->rows = ncolours;
+
+	return 0;
+}
 
-	s->newtp.c_iflag &= ~(IXON | IXOFF | IXANY );
+void atlas_free( struct glyph_atlas_s *a ) {
+	if (a->texture) SDL_DestroyTexture(a->texture);
+	a->texture = NULL;
+	a->rows = 0;
+}
 
-	r = tcsetattr(s->fd, TCSANOW, &(s->newtp));
-	if (r) {
-		fprintf(stderr,"%s:%d: Error setting terminal (%s)\n", FL, strerror(errno));
-		exit(1);
+/*
+ * Draw text at x,y using atlas row 'row'
+ *
+ * Returns the width drawn, or -1 without drawing anything if
+ * the text holds a character we don't have pre-rendered.
+ *
+ */
+int atlas_draw( struct glyph_atlas_s *a, SDL_Renderer *renderer, int row, const char *text, int x, int y ) {
+	const char *p;
+	int x0 = x;
+
+	if ((!a->texture)||(row >= a->rows)) return -1;
+	for (p = text; *p; p++) {
+		if (a->index[(uint8_t)*p] < 0) return -1;
 	}
 
-	fprintf(stdout,"Serial port opened, FD[%d]\n", s->fd);
+	for (p = text; *p; p++) {
+		SDL_Rect src = a->glyph[(int)a->index[(uint8_t)*p]];
+		SDL_Rect dst = { x, y, src.w, src.h };
+
+		src.y = row *a->height;
+		if (*p != ' ') SDL_RenderCopy(renderer, a->texture, &src, &dst);
+		x += src.w;
+	}
+
+	return x -x0;
+}
+
+/*
+ * Draw a line of text, from the atlas when we can (a may be
+ * NULL), otherwise by rasterising it through SDL_ttf.
+ *
+ * Returns the height of the line drawn
+ *
+ */
+int draw_text( struct glyph_atlas_s *a, SDL_Renderer *renderer, TTF_Font *font, int row, SDL_Color colour, const char *text, int x, int y ) {
+	SDL_Surface *surface;
+	SDL_Texture *texture;
+	int texW = 0;
+	int texH = 0;
+
+	if (a && (atlas_draw(a, renderer, row, text, x, y) >= 0)) return a->height;
+
+	surface = TTF_RenderUTF8_Solid(font, text, colour);
+	if (!surface) return 0;
+	texture = SDL_CreateTextureFromSurface(renderer, surface);
+	SDL_QueryTexture(texture, NULL, NULL, &texW, &texH);
+	SDL_Rect dstrect = { x, y, texW, texH };
+	SDL_RenderCopy(renderer, texture, NULL, &dstrect);
+	SDL_DestroyTexture(texture);
+	SDL_FreeSurface(surface);
+
+	return texH;
+}
 #endif
+
+/*
+ * Microseconds in whatever unit reads best
+ *
+ */
+char *fmt_us( char *b, size_t s, uint32_t us ) {
+	if (us < 1000) snprintf(b, s, "%uus", us);
+	else if (us < 1000000) snprintf(b, s, "%.2fms", us /1000.0);
+	else snprintf(b, s, "%.2fs", us /1000000.0);
+
+	return b;
 }
 
-uint8_t a2h( uint8_t a ) {
-	a -= 0x30;
-	if (a < 10) return a;
-	a -= 7;
-	return a;
+/*
+ * Print what the HUD knows, for the end of the run
+ *
+ */
+void perf_summary( struct glb *g ) {
+	char p50[16], p99[16], max[16];
+
+	for (int i = 0; i < g->ndev; i++) {
+		struct device_s *d = &(g->devices[i]);
+		struct perf_hist_s *h = &(d->latency);
+
+		fprintf(stdout,"%s: %llu samples, latency p50 %s p99 %s max %s, %u timeouts, %u I/O errors, %u overruns\n"
+				, d->device
+				, (unsigned long long)h->count.load()
+				, fmt_us(p50, sizeof(p50), perf_hist_percentile(h, 50))
+				, fmt_us(p99, sizeof(p99), perf_hist_percentile(h, 99))
+				, fmt_us(max, sizeof(max), h->max.load())
+				, d->timeouts.load()
+				, d->io_errors.load()
+				, d->overruns.load()
+				);
+
+		h = &(d->cmd_latency);
+		if (h->count.load() == 0) continue;
+		fprintf(stdout,"%s: %llu commands, posted to sent p50 %s p99 %s max %s\n"
+				, d->device
+				, (unsigned long long)h->count.load()
+				, fmt_us(p50, sizeof(p50), perf_hist_percentile(h, 50))
+				, fmt_us(p99, sizeof(p99), perf_hist_percentile(h, 99))
+				, fmt_us(max, sizeof(max), h->max.load())
+				);
+	}
+
+	if (g->render.count.load() == 0) return;
+	fprintf(stdout,"render: %llu frames, p50 %s p99 %s max %s\n"
+			, (unsigned long long)g->render.count.load()
+			, fmt_us(p50, sizeof(p50), perf_hist_percentile(&(g->render), 50))
+			, fmt_us(p99, sizeof(p99), perf_hist_percentile(&(g->render), 99))
+			, fmt_us(max, sizeof(max), g->render.max.load())
+			);
 }
 
-int data_read( glb *g, char *b, ssize_t s ) {
-	ssize_t sz;
-	if (g->comms_mode == CMODE_USB) {
-		/*
-		 * usb mode read
-		 *
-		 */
-		int bp = 0;
-		do {
-			sz = read(g->usb_fhandle, b+bp, s -1 -bp);
-			b[bp+sz] = '\0';
-
-			if (sz == -1) {
-				g->error_flag = true;
-				fprintf(stdout,"Error reading data: %s\n", strerror(errno));
-				snprintf(b, s, "NODATA");
-				break;
-			}
+#ifndef HEADLESS_ONLY
+/*
+ * h:mm:ss
+ *
+ */
+char *fmt_duration( char *b, size_t s, uint64_t us ) {
+	uint64_t t = us /1000000;
 
-			bp += sz;
-			if (sz == 0) break;
-			if (bp >= s) break;
-			usleep(1000);
-		} while (sz);
-		b[bp] = '\0';
-		if ((bp > 0) && b[bp-1] == '\n') b[bp -1] = '\0';
+	snprintf(b, s, "%llu:%02llu:%02llu"
+			, (unsigned long long)(t /3600)
+			, (unsigned long long)((t /60) %60)
+			, (unsigned long long)(t %60)
+			);
 
-	} else {
-		/*
-		 * serial mode read
-		 *
-		 */
-		int bp = 0;
-		ssize_t bytes_read = 0;
-
-		do {
-			char temp_char;
-			bytes_read = read(g->serial_params.fd, &temp_char, 1);
-			if (bytes_read) {
-				b[bp] = temp_char;
-				if (b[bp] == '\n') break;
-				bp++;
-			}
-		} while (bytes_read && bp < s);
-		b[bp] = '\0';
+	return b;
+}
+
+/*
+ * The statistics block for one device, STATS_LINES lines
+ *
+ */
+void format_stats( struct stats_s *st, const struct model_profile_s *p, uint64_t now, char lines[][96] ) {
+	char mn[24], mx[24], dur[24];
+
+	if (st->samples == 0) {
+		for (int i = 0; i < STATS_LINES; i++) lines[i][0] = '\0';
+		return;
 	}
-	return sz;
+
+	format_micro(mn, sizeof(mn), st->v_min, p->v_decimals, 0);
+	format_micro(mx, sizeof(mx), st->v_max, p->v_decimals, 0);
+	snprintf(lines[0], 96, "V min %s max %s avg %.3f rms %.3f", mn, mx, stats_mean_v(st), stats_rms_v(st));
+
+	format_micro(mn, sizeof(mn), st->a_min, p->a_decimals, 0);
+	format_micro(mx, sizeof(mx), st->a_max, p->a_decimals, 0);
+	snprintf(lines[1], 96, "A min %s max %s avg %.3f rms %.3f", mn, mx, stats_mean_a(st), stats_rms_a(st));
+
+	snprintf(lines[2], 96, "%.4fWh %.4fAh in %s", stats_wh(st), stats_ah(st), fmt_duration(dur, sizeof(dur), now -st->since));
 }
 
-int data_write( glb *g, char *d, ssize_t s ) { 
-		ssize_t sz;
+/*
+ * Draw a device's trend in to area, volts and amps each
+ * scaled to fill the height.
+ *
+ * Each column is a vertical stroke from its min to its max,
+ * alternately drawn up and down so that consecutive strokes
+ * join in to one polyline, which goes to SDL in a single
+ * SDL_RenderDrawLines() call per unbroken run.  pts needs
+ * room for two points per column.
+ *
+ */
+void trend_draw( SDL_Renderer *renderer, struct trend_s *t, SDL_Rect *area, SDL_Color cv, SDL_Color ca, SDL_Point *pts ) {
+	for (int trace = 0; trace < 2; trace++) {
+		SDL_Color *c = trace?&ca:&cv;
+		int64_t lo = INT64_MAX;
+		int64_t hi = INT64_MIN;
+		int64_t range;
+		int n = 0;
+
+		for (int k = 0; k < t->columns; k++) {
+			struct trend_col_s *col = &(t->col[k]);
+			if (!col->used) continue;
+			if ((trace?col->a_min:col->v_min) < lo) lo = trace?col->a_min:col->v_min;
+			if ((trace?col->a_max:col->v_max) > hi) hi = trace?col->a_max:col->v_max;
+		}
+		if (lo > hi) continue;
 
-	if (g->comms_mode == CMODE_USB) {
-		/*
-		 * usb mode write
-		 *
-		 */
-		sz = write(g->usb_fhandle, d, s); //"MEAS:VOLT?", sizeof("MEAS:VOLT?"));
-		if (sz < 0) {
-			g->error_flag = true;
-			fprintf(stdout,"Error sending USB data: %s\n", strerror(errno));
-			snprintf(d,s-1,"NODATA");
-			//exit(1);
-		}
-	} else {
-		/*
-		 * serial mode write
-		 *
-		 */
-		sz = write(g->serial_params.fd, d, s); 
-		if (sz < 0) {
-			g->error_flag = true;
-			fprintf(stdout,"Error sending serial data: %s\n", strerror(errno));
-			snprintf(d,s-1,"NODATA");
+		range = hi -lo;
+		if (range < TREND_MIN_RANGE) {
+			lo -= (TREND_MIN_RANGE -range) /2;
+			range = TREND_MIN_RANGE;
+		}
+
+		SDL_SetRenderDrawColor(renderer, c->r, c->g, c->b, 255);
+
+		for (int k = 0; k <= t->columns; k++) {
+			struct trend_col_s *col = &(t->col[(t->head +1 +k) % t->columns]);
+			int64_t mn, mx;
+			int x, y0, y1;
+
+			if ((k == t->columns)||(!col->used)) {
+				if (n > 1) SDL_RenderDrawLines(renderer, pts, n);
+				n = 0;
+				continue;
+			}
+
+			mn = trace?col->a_min:col->v_min;
+			mx = trace?col->a_max:col->v_max;
+			x = area->x +(k *area->w) /t->columns;
+			y0 = area->y +area->h -1 -(int)(((mn -lo) *(area->h -1)) /range);
+			y1 = area->y +area->h -1 -(int)(((mx -lo) *(area->h -1)) /range);
+
+			pts[n++] = { x, (k & 1)?y1:y0 };
+			pts[n++] = { x, (k & 1)?y0:y1 };
+		}
+	}
+}
+
+/*
+ * Setpoint and output keys, the change is posted to the
+ * engine and goes out ahead of the device's next measurement
+ *
+ */
+void handle_control_key( struct glb *g, SDL_Keysym *k ) {
+	struct ctl_cmd_s cmd;
+	int mult = (k->mod & KMOD_SHIFT)?10:1;
+
+	if ((k->sym >= SDLK_1) && (k->sym <= SDLK_9)) {
+		if (k->sym -SDLK_1 < g->ndev) {
+			g->control_dev = k->sym -SDLK_1;
+			fprintf(stdout,"Keys now control %s\n", g->devices[g->control_dev].device);
 		}
+		return;
+	}
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.dev = g->control_dev;
+	cmd.how = CTL_STEP;
+	switch (k->sym) {
+		case SDLK_UP: cmd.what = CTL_VOLT; cmd.value = KEY_VOLT_STEP *mult; break;
+		case SDLK_DOWN: cmd.what = CTL_VOLT; cmd.value = -KEY_VOLT_STEP *mult; break;
+		case SDLK_RIGHT: cmd.what = CTL_CURR; cmd.value = KEY_CURR_STEP *mult; break;
+		case SDLK_LEFT: cmd.what = CTL_CURR; cmd.value = -KEY_CURR_STEP *mult; break;
+		case SDLK_o: cmd.what = CTL_OUTPUT; cmd.how = CTL_TOGGLE; break;
+		default: return;
 	}
 
-	return sz;
+	if (!control_post(&(g->control), &cmd)) fprintf(stdout,"Too many commands queued, ignoring key\n");
+}
+
+/*
+ * Handle one SDL event for the render loop
+ *
+ * Sets *dirty when the window needs redrawing even though the
+ * readout hasn't changed (exposed, resized, etc), and *reset
+ * when the statistics should start over
+ *
+ */
+void handle_event( struct glb *g, SDL_Event *event, bool *quit, bool *dirty, bool *reset ) {
+	switch (event->type)
+	{
+		case SDL_KEYDOWN:
+			if (event->key.keysym.sym == SDLK_q) *quit = true;
+			else if (event->key.keysym.sym == SDLK_r) *reset = true;
+			else handle_control_key(g, &(event->key.keysym));
+			break;
+		case SDL_QUIT:
+			*quit = true;
+			break;
+		case SDL_WINDOWEVENT:
+			switch (event->window.event) {
+				case SDL_WINDOWEVENT_SHOWN:
+				case SDL_WINDOWEVENT_EXPOSED:
+				case SDL_WINDOWEVENT_RESIZED:
+				case SDL_WINDOWEVENT_SIZE_CHANGED:
+					*dirty = true;
+					break;
+			}
+			break;
+	}
 }
+#endif
 
 #ifdef __WIN32
 void parse_serial_parameters( struct glb *g ) {
@@ -551,273 +1083,667 @@ void parse_serial_parameters( struct glb *g ) {
 }
 #endif
 
-/*-----------------------------------------------------------------\
-  Date Code:	: 20180127-220307
-  Function Name	: main
-  Returns Type	: int
-  ----Parameter List
-  1. int argc,
-  2.  char **argv ,
-  ------------------
-  Exit Codes	:
-  Side Effects	:
-  --------------------------------------------------------------------
-Comments:
-
---------------------------------------------------------------------
-Changes:
-
-\------------------------------------------------------------------*/
-int main ( int argc, char **argv ) {
-
+#ifndef HEADLESS_ONLY
+/*
+ * The window: draws whatever the acquisition thread
+ * publishes until the user closes it
+ *
+ */
+void run_display( struct glb *g ) {
 	SDL_Event event;
-	SDL_Surface *surface, *surface_2;
-	SDL_Texture *texture, *texture_2;
-
+	struct glyph_atlas_s atlas;
 	char linetmp[SSIZE]; // temporary string for building main line of text
-
-	struct glb g;        // Global structure for passing variables around
-	int i = 0;           // Generic counter
-	char temp_char;        // Temporary character
 	char tfn[4096];
 	bool quit = false;
+	int i;
 
-	glbs = &g;
+	if (g->output_file) snprintf(tfn,sizeof(tfn),"%s.tmp",g->output_file);
 
 	/*
-	 * Initialise the global structure
+	 * Setup SDL2 and fonts
+	 *
 	 */
-	init(&g);
+
+	SDL_Init(SDL_INIT_VIDEO);
+	TTF_Init();
+	TTF_Font *font = TTF_OpenFont("RobotoMono-Regular.ttf", g->font_size);
+	TTF_Font *font_small = TTF_OpenFont("RobotoMono-Regular.ttf", g->font_size/4);
 
 	/*
-	 * Parse our command line parameters
+	 * Get the required window size.
+	 *
+	 * Parameters passed can override the font self-detect sizing
+	 *
 	 */
-	parse_parameters(&g, argc, argv);
-	if (g.device == NULL) {
-		fprintf(stdout,"Require valid device (ie, -p /dev/usbtmc2 )\nExiting\n");
-		exit(1);
-	}
-
-	fprintf(stdout,"START\n");
-
-	if (strstr(g.device,"usbtmc")) {
-		fprintf(stdout,"\nUsing USB mode\n\n");
-		fflush(stdout);
-		g.comms_mode = CMODE_USB;
-		snprintf(g.meas_volt,sizeof(g.meas_volt),"%s", MEAS_VOLT);
-		snprintf(g.meas_curr,sizeof(g.meas_curr),"%s", MEAS_CURR);
-	} else {
-		fprintf(stdout,"\nUsing SERIAL mode\n\n");
-		fflush(stdout);
-		g.comms_mode = CMODE_SERIAL;
-		g.serial_params.device = g.device;
-		snprintf(g.meas_volt,sizeof(g.meas_volt),"%s\n", MEAS_VOLT);
-		snprintf(g.meas_curr,sizeof(g.meas_curr),"%s\n", MEAS_CURR);
-	}
+	TTF_SizeText(font, " 00.000V ", &g->window_width, &g->window_height);
+	g->window_height *= 1.85;
+	int readout_height = g->window_height; // one volts/amps pair
 
-	/* 
-	 * check paramters
+	/*
+	 * Statistics go in font_small under each device's readout
 	 *
 	 */
-	if (g.font_size < 10) g.font_size = 10;
-	if (g.font_size > 200) g.font_size = 200;
-
-	if (g.output_file) snprintf(tfn,sizeof(tfn),"%s.tmp",g.output_file);
-
-
-	if ( g.comms_mode == CMODE_SERIAL ) {
-		/* 
-		 * handle the serial port
-		 *
-		 */
-		open_port( &g );
-
-	} else {
-		/*
-		 * Handle the USB port
-		 *
-		 */
-
-		g.usb_fhandle = open( g.device, O_RDWR );
-		if (g.usb_fhandle == -1) {
-			fprintf(stdout, "Error opening device [%s] : %s\n", g.device, strerror(errno));
-			exit (1);
-		}
-	}
+	int stats_line = 0;
+	if (g->show_stats && font_small) stats_line = TTF_FontLineSkip(font_small);
 
 	/*
-	 * Setup SDL2 and fonts
+	 * and the trend chart under that
 	 *
 	 */
+	int trend_height = 0;
+	if (g->trend_span) trend_height = g->font_size *3 /2;
 
-	SDL_Init(SDL_INIT_VIDEO);
-	TTF_Init();
-	TTF_Font *font = TTF_OpenFont("RobotoMono-Regular.ttf", g.font_size);
-	TTF_Font *font_small = TTF_OpenFont("RobotoMono-Regular.ttf", g.font_size/4);
+	int block_height = readout_height +stats_line *STATS_LINES +trend_height;
+	g->window_height = block_height *g->ndev;
 
 	/*
-	 * Get the required window size.
-	 *
-	 * Parameters passed can override the font self-detect sizing
+	 * The HUD sits under the readouts, a line per device and
+	 * one for the display itself
 	 *
 	 */
-	TTF_SizeText(font, " 00.000V ", &g.window_width, &g.window_height);
-	g.window_height *= 1.85;
+	int hud_line = 0;
+	if (g->perf_hud && font_small) {
+		hud_line = TTF_FontLineSkip(font_small);
+		g->window_height += hud_line *(g->ndev +1);
+	}
 
-	if (g.wx_forced) g.window_width = g.wx_forced;
-	if (g.wy_forced) g.window_height = g.wy_forced;
+	if (g->wx_forced) g->window_width = g->wx_forced;
+	if (g->wy_forced) g->window_height = g->wy_forced;
 
-	SDL_Window *window = SDL_CreateWindow("MP7100", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, g.window_width, g.window_height, 0);
+	SDL_Window *window = SDL_CreateWindow("MP7100", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, g->window_width, g->window_height, 0);
 	SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, 0);
 	if (!font) {
 		fprintf(stderr,"Error trying to open font :( \r\n");
 		exit(1);
 	}
 
+	/*
+	 * Pre-render the readout glyphs, row 0 is volts, row 1 amps
+	 *
+	 */
+	{
+		SDL_Color colours[2] = { g->font_color_volts, g->font_color_amps };
+		if (atlas_build(&atlas, renderer, font, colours, 2) != 0) {
+			fprintf(stderr,"%s:%d: Unable to build glyph atlas, rendering text per frame\n", FL);
+		}
+	}
+
 	/* Select the color for drawing. It is set to red here. */
-	SDL_SetRenderDrawColor(renderer, g.background_color.r, g.background_color.g, g.background_color.b, 255 );
+	SDL_SetRenderDrawColor(renderer, g->background_color.r, g->background_color.g, g->background_color.b, 255 );
 
 	/* Clear the entire screen to our selected color. */
 	SDL_RenderClear(renderer);
 
+	/*
+	 * Hand the devices over to the acquisition thread, from
+	 * here on this thread only draws what it publishes
+	 *
+	 */
+	pthread_t acq_tid;
+	if (pthread_create(&acq_tid, NULL, acquisition_thread, g) != 0) {
+		fprintf(stderr,"%s:%d: Unable to start acquisition thread\n", FL);
+		exit(1);
+	}
+
+	/*
+	 * What's currently shown for each device
+	 *
+	 */
+	struct readout_s {
+		char line1[64];
+		char line2[64];
+		uint64_t hud_count; // latency.count at the last HUD update
+		double hud_rate; // samples/s
+		struct stats_s stats;
+		char stats_text[STATS_LINES][96];
+		struct trend_s trend;
+	} *readouts = (struct readout_s *)calloc(g->ndev, sizeof(struct readout_s));
+	if (!readouts) {
+		fprintf(stderr,"%s:%d: Out of memory\n", FL);
+		exit(1);
+	}
+
+	/*
+	 * A column of trend per pixel across the window
+	 *
+	 */
+	SDL_Point *trend_pts = NULL;
+	if (trend_height) {
+		for (i = 0; i < g->ndev; i++) {
+			if (trend_init(&(readouts[i].trend), g->window_width, (uint64_t)g->trend_span *1000000) != 0) {
+				fprintf(stderr,"%s:%d: Out of memory\n", FL);
+				exit(1);
+			}
+		}
+		trend_pts = (SDL_Point *)calloc(readouts[0].trend.columns *2, sizeof(SDL_Point));
+		if (!trend_pts) {
+			fprintf(stderr,"%s:%d: Out of memory\n", FL);
+			exit(1);
+		}
+	}
+	linetmp[0] = '\0';
+
 	/*
 	 *
 	 * Parent will terminate us... else we'll become a zombie
 	 * and hope that the almighty PID 1 will reap us
 	 *
 	 */
+	uint64_t frame_us = 1000000 /g->max_fps;
+	uint64_t next_frame = monotonic_us();
+	uint64_t hud_last = next_frame;
+	uint64_t stats_last = 0;
+	bool dirty = true;
+	bool reset = false;
+
 	while (!quit) {
-		char line1[1024];
-		char line2[1024];
-		char buf_volt[100];
-		char buf_curr[100];
-
-		char *p, *q;
-		double v = 0.0;
-		int end_of_frame_received = 0;
-		uint8_t range;
-		uint8_t dpp = 0;
-		ssize_t bytes_read = 0;
-		ssize_t sz;
-
-
-		while (SDL_PollEvent(&event)) {
-			switch (event.type)
-			{
-				case SDL_KEYDOWN:
-					if (event.key.keysym.sym == SDLK_q) quit = true;
-					break;
-				case SDL_QUIT:
-					quit = true;
-					break;
-			}
+		struct sample_s smp;
+		bool fresh = false;
+		uint64_t now;
+
+		/*
+		 * Sleep in SDL until either something happens to the
+		 * window or it's time for the next frame slot
+		 *
+		 */
+		now = monotonic_us();
+		if (SDL_WaitEventTimeout(&event, (next_frame > now)?(next_frame -now +999) /1000:0)) {
+			handle_event(g, &event, &quit, &dirty, &reset);
+			while (SDL_PollEvent(&event)) handle_event(g, &event, &quit, &dirty, &reset);
 		}
 
-		linetmp[0] = '\0';
+		now = monotonic_us();
+		if (now < next_frame) continue;
+		next_frame = now +frame_us;
 
+		if (reset) {
+			for (i = 0; i < g->ndev; i++) stats_reset(&(readouts[i].stats));
+			stats_last = 0;
+			reset = false;
+		}
 
 		/*
-		if (g.error_flag) {
-			f = open( g.device, O_RDWR );
-			if (f == -1) {
-				fprintf(stdout, "Error opening device [%s] : %s\n", g.device, strerror(errno));
-				sleep(1);
-			} else {
-				error_flag = false;
+		 * We only ever show the latest sample, so drain
+		 * anything that queued up since the last frame, every
+		 * one of them goes in to the statistics though
+		 *
+		 */
+		for (i = 0; i < g->ndev; i++) {
+			struct device_s *d = &(g->devices[i]);
+			struct readout_s *ro = &(readouts[i]);
+			bool got = false;
+
+			while (sample_ring_pop(&(d->ring), &smp)) {
+				stats_add(&(ro->stats), &smp);
+				if (trend_height && trend_add(&(ro->trend), &smp)) dirty = true;
+				got = true;
 			}
+			if (trend_height && trend_advance(&(ro->trend), now)) dirty = true;
+			if (!got) continue;
 
-		}
-		*/
+			bool err = smp.flags & SAMPLE_ERROR;
+			char l1[sizeof(ro->line1)], l2[sizeof(ro->line2)];
 
-		sz = data_write( &g, g.meas_volt, strlen(g.meas_volt)  );
-		usleep(20000);
-		sz = data_read( &g, buf_volt, sizeof(buf_volt) );
+			if (err) {
+				snprintf(l1, sizeof(l1), "%7s", sample_error_text(smp.flags));
+				snprintf(l2, sizeof(l2), "%7s", sample_error_text(smp.flags));
+			} else {
+				int n;
 
-		sz = data_write( &g, g.meas_curr, strlen(g.meas_curr));
-		usleep(20000);
-		sz = data_read( &g, buf_curr, sizeof(buf_curr));
+				n = format_micro(l1, sizeof(l1) -1, smp.uv, d->profile->v_decimals, READOUT_WIDTH);
+				if (n >= 0) memcpy(l1 +n, "V", 2);
+				n = format_micro(l2, sizeof(l2) -1, smp.ua, d->profile->a_decimals, READOUT_WIDTH);
+				if (n >= 0) memcpy(l2 +n, "A", 2);
+			}
+			if (strcmp(l1, ro->line1) || strcmp(l2, ro->line2)) {
+				memcpy(ro->line1, l1, sizeof(l1));
+				memcpy(ro->line2, l2, sizeof(l2));
+				dirty = true;
+			}
+			if (g->debug) fprintf(stdout,"%s: %s %s\n", d->device, ro->line1, ro->line2);
+			fresh = true;
+		}
 
 		/*
-		 *
-		 * END OF DATA ACQUISITION
+		 * The HUD changes every time it's updated, so keep that
+		 * to a couple of times a second
 		 *
 		 */
+		if (hud_line && (now -hud_last >= PERF_HUD_REFRESH)) {
+			for (i = 0; i < g->ndev; i++) {
+				uint64_t c = g->devices[i].latency.count.load(std::memory_order_relaxed);
+				readouts[i].hud_rate = (c -readouts[i].hud_count) *1000000.0 /(now -hud_last);
+				readouts[i].hud_count = c;
+			}
+			hud_last = now;
+			dirty = true;
+		}
 
+		if (stats_line && (now -stats_last >= STATS_REFRESH)) {
+			for (i = 0; i < g->ndev; i++) {
+				char l[STATS_LINES][96];
 
-		//snprintf(line1, sizeof(line1)-1, "%s%s", buf_volt, error_flag?"":"V");
-		snprintf(line1, sizeof(line1), "%7s%s", buf_volt, g.error_flag?"":"V");
-		snprintf(line2, sizeof(line2), "%7s%s", buf_curr, g.error_flag?"":"A");
-		if (g.debug) fprintf(stdout,"%s\n%s\n", line1, line2);
+				memset(l, 0, sizeof(l));
+				format_stats(&(readouts[i].stats), g->devices[i].profile, now, l);
+				if (memcmp(l, readouts[i].stats_text, sizeof(l))) {
+					memcpy(readouts[i].stats_text, l, sizeof(l));
+					dirty = true;
+				}
+			}
+			stats_last = now;
+		}
 
+		if (fresh) {
+			size_t o = 0;
 
-		{
-			int texW = 0;
-			int texH = 0;
-			int texW2 = 0;
-			int texH2 = 0;
-			SDL_RenderClear(renderer);
-			surface = TTF_RenderUTF8_Solid(font, line1, g.font_color_volts);
-			texture = SDL_CreateTextureFromSurface(renderer, surface);
-			SDL_QueryTexture(texture, NULL, NULL, &texW, &texH);
-			SDL_Rect dstrect = { 0, 0, texW, texH };
-			SDL_RenderCopy(renderer, texture, NULL, &dstrect);
-
-			surface_2 = TTF_RenderUTF8_Solid(font, line2, g.font_color_amps);
-			texture_2 = SDL_CreateTextureFromSurface(renderer, surface_2);
-			SDL_QueryTexture(texture_2, NULL, NULL, &texW2, &texH2);
-			dstrect = { 0, texH -(texH /5), texW2, texH2 };
-			SDL_RenderCopy(renderer, texture_2, NULL, &dstrect);
+			linetmp[0] = '\0';
+			for (i = 0; (i < g->ndev) && (o < sizeof(linetmp)); i++) {
+				o += snprintf(linetmp +o, sizeof(linetmp) -o, "%s%s %s", i?"\n":"", readouts[i].line1, readouts[i].line2);
+			}
+		}
 
-			SDL_RenderPresent(renderer);
 
-			SDL_DestroyTexture(texture);
-			SDL_FreeSurface(surface);
-			if (1) {
-				SDL_DestroyTexture(texture_2);
-				SDL_FreeSurface(surface_2);
-			}
+		/*
+		 * Only redraw when the readout or the window actually
+		 * changed, an unchanged frame costs us nothing
+		 *
+		 */
+		if (dirty) {
+			uint64_t render_start = monotonic_us();
 
-			if (g.error_flag) {
-				sleep(1);
-			} else {
-				usleep(g.interval);
+			SDL_RenderClear(renderer);
+			for (i = 0; i < g->ndev; i++) {
+				struct readout_s *ro = &(readouts[i]);
+				int y = i *block_height;
+				int texH;
+
+				if (!ro->line1[0]) continue;
+				texH = draw_text(&atlas, renderer, font, 0, g->font_color_volts, ro->line1, 0, y);
+				draw_text(&atlas, renderer, font, 1, g->font_color_amps, ro->line2, 0, y +texH -(texH /5));
+
+				for (int k = 0; (k < STATS_LINES) && stats_line; k++) {
+					if (!ro->stats_text[k][0]) continue;
+					draw_text(NULL, renderer, font_small, 0, (k == 1)?g->font_color_amps:g->font_color_volts, ro->stats_text[k], 0, y +readout_height +k *stats_line);
+				}
+
+				if (trend_height) {
+					SDL_Rect area = { 0, y +readout_height +stats_line *STATS_LINES, g->window_width, trend_height };
+					trend_draw(renderer, &(ro->trend), &area, g->font_color_volts, g->font_color_amps, trend_pts);
+					SDL_SetRenderDrawColor(renderer, g->background_color.r, g->background_color.g, g->background_color.b, 255);
+				}
 			}
 
+			if (hud_line) {
+				char l[128], last[16], p99[16];
+				int y = g->ndev *block_height;
+
+				for (i = 0; i < g->ndev; i++, y += hud_line) {
+					struct device_s *d = &(g->devices[i]);
+
+					snprintf(l, sizeof(l), "%s %.1f/s lat %s p99 %s to %u err %u ovr %u"
+							, d->device
+							, readouts[i].hud_rate
+							, fmt_us(last, sizeof(last), d->latency.last.load(std::memory_order_relaxed))
+							, fmt_us(p99, sizeof(p99), perf_hist_percentile(&(d->latency), 99))
+							, d->timeouts.load(std::memory_order_relaxed)
+							, d->io_errors.load(std::memory_order_relaxed)
+							, d->overruns.load(std::memory_order_relaxed)
+							);
+					draw_text(NULL, renderer, font_small, 0, g->font_color_volts, l, 0, y);
+				}
+
+				snprintf(l, sizeof(l), "render %s p99 %s"
+						, fmt_us(last, sizeof(last), g->render.last.load(std::memory_order_relaxed))
+						, fmt_us(p99, sizeof(p99), perf_hist_percentile(&(g->render), 99))
+						);
+				draw_text(NULL, renderer, font_small, 0, g->font_color_amps, l, 0, y);
+			}
 
+			SDL_RenderPresent(renderer);
+			perf_hist_add(&(g->render), monotonic_us() -render_start);
+			dirty = false;
 		}
 
 
-		if (g.output_file) {
+		if (g->output_file && fresh) {
 			/*
 			 * Only write the file out if it doesn't
 			 * exist. 
 			 *
 			 */
-			if (!fileExists(g.output_file)) {
+			if (!fileExists(g->output_file)) {
 				FILE *f;
-				fprintf(stderr,"%s:%d: output filename = %s\r\n", FL, g.output_file);
+				fprintf(stderr,"%s:%d: output filename = %s\r\n", FL, g->output_file);
 				f = fopen(tfn,"w");
 				if (f) {
 					fprintf(f,"%s", linetmp);
 					fprintf(stderr,"%s:%d: %s => %s\r\n", FL, linetmp, tfn);
 					fclose(f);
-					rename(tfn, g.output_file);
+					rename(tfn, g->output_file);
 				}
 			}
 		}
 
 	} // while(1)
 
-	if (g.comms_mode == CMODE_USB) {
-		close(g.usb_fhandle);
+	g->quit = true;
+	pthread_join(acq_tid, NULL);
+
+	if (trend_height) {
+		for (i = 0; i < g->ndev; i++) trend_free(&(readouts[i].trend));
+		free(trend_pts);
 	}
+	free(readouts);
 
+	atlas_free(&atlas);
 	TTF_CloseFont(font);
+	if (font_small) TTF_CloseFont(font_small);
 	SDL_DestroyRenderer(renderer);
 	SDL_DestroyWindow(window);
 	TTF_Quit();
 	SDL_Quit();
 
+}
+#endif
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20180127-220307
+  Function Name	: main
+  Returns Type	: int
+  ----Parameter List
+  1. int argc,
+  2.  char **argv ,
+  ------------------
+  Exit Codes	:
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+int main ( int argc, char **argv ) {
+
+	struct glb g;        // Global structure for passing variables around
+	int i = 0;           // Generic counter
+
+	glbs = &g;
+
+	/*
+	 * Initialise the global structure
+	 */
+	init(&g);
+
+	/*
+	 * Parse our command line parameters
+	 */
+	parse_parameters(&g, argc, argv);
+
+	/*
+	 * A replay brings its own devices
+	 *
+	 */
+	if (g.replay_file) {
+		if (g.ndev) {
+			fprintf(stdout,"-R replays the devices in the capture, it can't be used with -p\n");
+			exit(1);
+		}
+		if (replay_open(&g.replay, g.replay_file, g.replay_fast) != 0) {
+			fprintf(stdout,"Error opening capture [%s] : %s\n", g.replay_file, strerror(errno));
+			exit(1);
+		}
+		for (i = 0; i < g.replay.ndev; i++) g.device_paths[g.ndev++] = g.replay.dev[i].name;
+	}
+
+	/*
+	 * A bad profile is better found before the supply is
+	 * touched
+	 *
+	 */
+	if (g.ramp_file) {
+		if (g.replay_file) {
+			fprintf(stdout,"-x drives real supplies, it can't be used with -R\n");
+			exit(1);
+		}
+		if (ramp_load(&g.ramp, g.ramp_file) != 0) exit(1);
+	}
+
+	if (g.ndev == 0) {
+		fprintf(stdout,"Require valid device (ie, -p /dev/usbtmc2 )\nExiting\n");
+		exit(1);
+	}
+
+	/*
+	 * Headless without a log file streams the samples on
+	 * stdout, so everything else we (and the transport) have
+	 * to say goes to stderr instead
+	 *
+	 */
+	int sample_fd = -1;
+	if (g.headless && !g.log_file) {
+		sample_fd = dup(STDOUT_FILENO);
+		if ((sample_fd < 0)||(dup2(STDERR_FILENO, STDOUT_FILENO) < 0)) {
+			fprintf(stderr,"%s:%d: Unable to set up stdout (%s)\n", FL, strerror(errno));
+			exit(1);
+		}
+	}
+
+	fprintf(stdout,"START\n");
+
+	/* 
+	 * check paramters
+	 *
+	 */
+	if (g.font_size < 10) g.font_size = 10;
+	if (g.font_size > 200) g.font_size = 200;
+	if (g.headless && !g.interval_set) g.interval = 0;
+
+	/*
+	 * Set up and open every device we were given
+	 *
+	 */
+	g.devices = (struct device_s *)calloc(g.ndev, sizeof(struct device_s));
+	if (!g.devices) {
+		fprintf(stderr,"%s:%d: Out of memory\n", FL);
+		exit(1);
+	}
+
+	for (i = 0; i < g.ndev; i++) {
+		struct device_s *d = &(g.devices[i]);
+
+		device_init(d, i, g.device_paths[i]);
+		d->debug = g.debug;
+		d->acq_mode = g.acq_mode;
+		d->io_timeout = g.io_timeout;
+		d->interval = g.interval;
+		d->adapt.keepalive = g.keepalive;
+		d->adapt.dv = g.adapt_dv;
+		d->adapt.di = g.adapt_di;
+		d->serial_parameters_string = g.serial_parameters_string;
+		if (g.capture_file) d->capture = &g.capture;
+	}
+
+	/*
+	 * Capturing starts before the first byte goes out, so the
+	 * *IDN? exchange is in there too and a replay identifies
+	 * the same way
+	 *
+	 */
+	if (g.capture_file) {
+		if (capture_open(&g.capture, g.capture_file, g.devices, g.ndev) != 0) {
+			fprintf(stdout,"Error opening capture file [%s] : %s\n", g.capture_file, strerror(errno));
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < g.ndev; i++) {
+		struct device_s *d = &(g.devices[i]);
+
+		if (g.replay_file) {
+			if (replay_attach(&g.replay, d) != 0) {
+				fprintf(stdout, "Error setting up replay of [%s] : %s\n", d->device, strerror(errno));
+				exit(1);
+			}
+			fprintf(stdout,"\nReplaying %s (%s)\n\n", d->device, (d->comms_mode == CMODE_USB)?"USB":"SERIAL");
+			continue;
+		}
+
+		fprintf(stdout,"\nUsing %s mode for %s\n\n", (d->comms_mode == CMODE_USB)?"USB":"SERIAL", d->device);
+		fflush(stdout);
+
+		if (device_open(d) != 0) {
+			fprintf(stdout, "Error opening device [%s] : %s\n", d->device, strerror(errno));
+			exit (1);
+		}
+		if (d->comms_mode == CMODE_SERIAL) fprintf(stdout,"Serial port opened, FD[%d]\n", d->fd);
+	}
+
+	if (g.replay_file) {
+		if (replay_start(&g.replay, &g.quit) != 0) {
+			fprintf(stderr,"%s:%d: Unable to start replay (%s)\n", FL, strerror(errno));
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < g.ndev; i++) {
+		struct device_s *d = &(g.devices[i]);
+
+		if (device_identify(d) == 0) {
+			fprintf(stdout,"%s: %s, using the %s profile\n", d->device, d->idn, d->profile->name);
+		} else {
+			fprintf(stdout,"%s: No answer to *IDN?, using the %s profile\n", d->device, d->profile->name);
+		}
+		if (!g.acq_mode_set) d->acq_mode = d->profile->acq_mode;
+
+		if (device_setpoints(d) == 0) {
+			char v[24], a[24];
+
+			format_micro(v, sizeof(v), d->set_uv, d->profile->v_decimals, 0);
+			format_micro(a, sizeof(a), d->set_ua, d->profile->a_decimals, 0);
+			fprintf(stdout,"%s: Set to %sV %sA, output %s\n", d->device, v, a, (d->output == 1)?"on":(d->output == 0)?"off":"unknown");
+		} else {
+			fprintf(stdout,"%s: Couldn't read the setpoints, only absolute changes will work\n", d->device);
+		}
+	}
+
+	if (engine_init(&g.engine, g.devices, g.ndev) != 0) {
+		fprintf(stderr,"%s:%d: Unable to set up acquisition engine (%s)\n", FL, strerror(errno));
+		exit(1);
+	}
+	g.engine.on_sample = acq_publish;
+	g.engine.arg = &g;
+	g.engine.flat_out = g.replay_file && g.replay_fast;
+
+	if (control_open(&g.control, &g.engine) != 0) {
+		fprintf(stderr,"%s:%d: Unable to set up control (%s)\n", FL, strerror(errno));
+		exit(1);
+	}
+	if (g.control_path) {
+		if (control_listen(&g.control, g.control_path) != 0) {
+			fprintf(stdout,"Error opening control socket [%s] : %s\n", g.control_path, strerror(errno));
+			exit(1);
+		}
+	}
+
+	if (g.ramp_file) {
+		if (ramp_start(&g.ramp, &g.engine, &g.control) != 0) {
+			fprintf(stdout,"Error starting ramp profile [%s] on device %d : %s\n", g.ramp_file, g.ramp.dev, strerror(errno));
+			exit(1);
+		}
+	}
+
+	if (g.socket_path) {
+		if (publisher_open(&g.publisher, g.socket_path, &g.engine) != 0) {
+			fprintf(stdout,"Error opening sample socket [%s] : %s\n", g.socket_path, strerror(errno));
+			exit(1);
+		}
+	}
+
+	if (g.shm_name) {
+		if (shm_writer_open(&g.shm, g.shm_name, g.ndev) != 0) {
+			fprintf(stdout,"Error opening shared memory [%s] : %s\n", g.shm_name, strerror(errno));
+			exit(1);
+		}
+	}
+
+	if (g.log_file) {
+		if (logger_open(&g.logger, g.log_file, g.log_fsync) != 0) {
+			fprintf(stdout,"Error opening log file [%s] : %s\n", g.log_file, strerror(errno));
+			exit(1);
+		}
+	} else if (sample_fd >= 0) {
+		if (logger_open_fd(&g.logger, sample_fd, g.log_fsync) != 0) {
+			fprintf(stderr,"%s:%d: Out of memory\n", FL);
+			exit(1);
+		}
+	}
+	if (g.logger.fd >= 0) engine_idle(&g.engine, acq_idle, &g);
+
+#ifndef HEADLESS_ONLY
+	if (!g.headless) run_display(&g);
+	else
+#endif
+	run_headless(&g);
+
+	if (g.logger.fd >= 0) {
+		logger_close(&g.logger);
+		fprintf(stdout,"Logged %llu samples in %llu writes, %llu syncs, %u errors\n"
+				, (unsigned long long)g.logger.lines
+				, (unsigned long long)g.logger.flushes
+				, (unsigned long long)g.logger.fsyncs
+				, g.logger.errors
+				);
+	}
+
+	if (g.publisher.fd >= 0) {
+		publisher_close(&g.publisher);
+		if (g.publisher.dropped) {
+			fprintf(stdout,"Sample socket: %llu samples dropped for slow subscribers\n", (unsigned long long)g.publisher.dropped);
+		}
+	}
+
+	if (g.ramp_file) {
+		char p50[16], p99[16], max[16];
+
+		fprintf(stdout,"Ramp profile: %llu changes, timer late p50 %s p99 %s max %s\n"
+				, (unsigned long long)g.ramp.changes
+				, fmt_us(p50, sizeof(p50), perf_hist_percentile(&(g.ramp.late), 50))
+				, fmt_us(p99, sizeof(p99), perf_hist_percentile(&(g.ramp.late), 99))
+				, fmt_us(max, sizeof(max), g.ramp.late.max.load())
+				);
+		ramp_close(&g.ramp);
+	}
+	if (g.control.efd >= 0) control_close(&g.control);
+	shm_writer_close(&g.shm);
+	if (g.capture.fd >= 0) {
+		capture_close(&g.capture);
+		fprintf(stdout,"Captured %llu records, %llu bytes, %u write errors\n"
+				, (unsigned long long)g.capture.records
+				, (unsigned long long)g.capture.bytes
+				, g.capture.errors
+				);
+	}
+	engine_close(&g.engine);
+	if (g.perf_hud) perf_summary(&g);
+
+	for (i = 0; i < g.ndev; i++) {
+		struct device_s *d = &(g.devices[i]);
+
+		device_close(d);
+		if ((d->timeouts || d->io_errors) && !g.perf_hud) {
+			fprintf(stdout,"%s: %u transaction timeouts, %u I/O errors\n", d->device, d->timeouts.load(), d->io_errors.load());
+		}
+		if (d->overruns && !g.perf_hud) {
+			fprintf(stdout,"%s: %u sample periods overrun\n", d->device, d->overruns.load());
+		}
+		if (d->ring_drops) {
+			fprintf(stdout,"%s: %u samples dropped while the display was busy\n", d->device, d->ring_drops);
+		}
+	}
+	free(g.devices);
+	if (g.replay_file) replay_close(&g.replay);
+
 	return 0;
 
 }
@@ -0,0 +1,108 @@
+/*
+ * Multicomp MP7100  / OWON SP3051 / 3101 / 6031 / 5051
+ *
+ * Fixed bucket latency histograms for the performance HUD.
+ *
+ */
+
+#ifndef MP7100_PERF_H
+#define MP7100_PERF_H
+
+#include <stdint.h>
+#include <atomic>
+
+/*
+ * Log-linear buckets: values below 4 get a bucket each, above
+ * that every power of two is split in to four, so a bucket
+ * is never more than 25% wide.  128 buckets covers all of
+ * uint32_t microseconds.
+ *
+ * One writer only (the thread timing the thing), which lets
+ * adding a value be a few plain loads and stores rather than
+ * locked instructions.  Readers on other threads see counts
+ * that are at worst a sample or two behind.
+ *
+ */
+#define PERF_SUB_BITS 2
+#define PERF_BUCKETS 128
+
+struct perf_hist_s {
+	std::atomic<uint32_t> bucket[PERF_BUCKETS];
+	std::atomic<uint64_t> count;
+	std::atomic<uint32_t> last;
+	std::atomic<uint32_t> max;
+};
+
+static inline int perf_bucket( uint32_t v ) {
+	int msb;
+
+	if (v < (1 << PERF_SUB_BITS)) return v;
+	msb = 31 -__builtin_clz(v);
+
+	return ((msb -PERF_SUB_BITS +1) << PERF_SUB_BITS) +((v >> (msb -PERF_SUB_BITS)) & ((1 << PERF_SUB_BITS) -1));
+}
+
+/*
+ * Largest value that lands in bucket b
+ *
+ */
+static inline uint32_t perf_bucket_top( int b ) {
+	int shift;
+
+	if (b < (1 << PERF_SUB_BITS)) return b;
+	shift = (b >> PERF_SUB_BITS) -1;
+
+	return ((uint32_t)((1 << PERF_SUB_BITS) +(b & ((1 << PERF_SUB_BITS) -1)) +1) << shift) -1;
+}
+
+static inline void perf_hist_reset( struct perf_hist_s *h ) {
+	for (int i = 0; i < PERF_BUCKETS; i++) h->bucket[i].store(0, std::memory_order_relaxed);
+	h->count.store(0, std::memory_order_relaxed);
+	h->last.store(0, std::memory_order_relaxed);
+	h->max.store(0, std::memory_order_relaxed);
+}
+
+/*
+ * Writer side, record one value
+ *
+ */
+static inline void perf_hist_add( struct perf_hist_s *h, uint32_t v ) {
+	std::atomic<uint32_t> *b = &(h->bucket[perf_bucket(v)]);
+
+	b->store(b->load(std::memory_order_relaxed) +1, std::memory_order_relaxed);
+	h->count.store(h->count.load(std::memory_order_relaxed) +1, std::memory_order_relaxed);
+	h->last.store(v, std::memory_order_relaxed);
+	if (v > h->max.load(std::memory_order_relaxed)) h->max.store(v, std::memory_order_relaxed);
+}
+
+/*
+ * Value below which pct percent of the recorded values fall,
+ * to the resolution of the buckets (rounded up).  0 if the
+ * histogram is empty.
+ *
+ */
+static inline uint32_t perf_hist_percentile( struct perf_hist_s *h, double pct ) {
+	uint64_t total = 0, want, seen = 0;
+	uint32_t counts[PERF_BUCKETS];
+	uint32_t max = h->max.load(std::memory_order_relaxed);
+
+	for (int i = 0; i < PERF_BUCKETS; i++) {
+		counts[i] = h->bucket[i].load(std::memory_order_relaxed);
+		total += counts[i];
+	}
+	if (total == 0) return 0;
+
+	want = (uint64_t)(total *pct /100.0);
+	if (want < 1) want = 1;
+	for (int i = 0; i < PERF_BUCKETS; i++) {
+		seen += counts[i];
+		if (seen >= want) {
+			uint32_t top = perf_bucket_top(i);
+			return (top < max)?top:max;
+		}
+	}
+
+	return max;
+}
+
+#endif
@@ -0,0 +1,288 @@
+/*
+ * Multicomp MP7100  / OWON SP3051 / 3101 / 6031 / 5051
+ *
+ * Unix socket sample publisher
+ *
+ * Any number of local programs can connect to the stream
+ * socket and will get every sample from then on, one line
+ * each in exactly the format the logger writes (see
+ * logger.cpp), starting with the same header line.  Anything
+ * a subscriber sends is ignored.
+ *
+ *   socat - UNIX-CONNECT:/tmp/mp7100.sock
+ *
+ * Everything here runs on the engine thread: samples are
+ * queued by publisher_sample() and written out in one batch
+ * per engine pass by publisher_flush().
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "publisher.h"
+#include "logger.h"
+
+static void pub_drop( struct publisher_s *p, struct pub_client_s *c ) {
+	engine_unwatch(p->engine, c->fd);
+	close(c->fd);
+	c->fd = -1;
+	free(c->q);
+	c->q = NULL;
+	p->dropped += c->dropped;
+}
+
+/*
+ * A free slot for a new subscriber, doubling the table if
+ * they're all taken
+ *
+ * Returns NULL with errno set if it couldn't grow
+ *
+ */
+static struct pub_client_s *pub_slot( struct publisher_s *p ) {
+	struct pub_client_s *grown;
+	int n;
+
+	for (int i = 0; i < p->nclients; i++) {
+		if (p->clients[i].fd < 0) return &(p->clients[i]);
+	}
+
+	n = p->nclients?p->nclients *2:PUB_CLIENTS_INITIAL;
+	grown = (struct pub_client_s *)realloc(p->clients, n *sizeof(struct pub_client_s));
+	if (!grown) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	for (int i = p->nclients; i < n; i++) grown[i].fd = -1;
+	p->clients = grown;
+	p->nclients = n;
+
+	return &(p->clients[n /2]);
+}
+
+/*
+ * Queue as much of b as there's room for, whole or not at all
+ *
+ */
+static bool pub_queue( struct pub_client_s *c, const char *b, uint32_t n ) {
+	uint32_t at, first;
+
+	if (PUB_QUEUE_SIZE -(c->head -c->tail) < n) return false;
+
+	at = c->head & (PUB_QUEUE_SIZE -1);
+	first = PUB_QUEUE_SIZE -at;
+	if (first > n) first = n;
+	memcpy(c->q +at, b, first);
+	memcpy(c->q, b +first, n -first);
+	c->head += n;
+
+	return true;
+}
+
+/*
+ * Send as much of the queue as the socket will take without
+ * blocking, and only ask epoll about writability while
+ * there's a backlog
+ *
+ */
+static void pub_write( struct publisher_s *p, struct pub_client_s *c ) {
+	while (c->head != c->tail) {
+		uint32_t at = c->tail & (PUB_QUEUE_SIZE -1);
+		uint32_t n = c->head -c->tail;
+		struct iovec iov[2];
+		struct msghdr msg;
+		ssize_t sz;
+
+		iov[0].iov_base = c->q +at;
+		iov[0].iov_len = (n < PUB_QUEUE_SIZE -at)?n:PUB_QUEUE_SIZE -at;
+		iov[1].iov_base = c->q;
+		iov[1].iov_len = n -iov[0].iov_len;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iov[1].iov_len?2:1;
+
+		sz = sendmsg(c->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sz < 0) {
+			if (errno == EINTR) continue;
+			if ((errno == EAGAIN)||(errno == EWOULDBLOCK)) break;
+			pub_drop(p, c);
+			return;
+		}
+		c->tail += sz;
+		c->sent += sz;
+	}
+
+	if ((c->head != c->tail) != c->want_out) {
+		c->want_out = !c->want_out;
+		engine_watch_mod(p->engine, c->fd, EPOLLIN | EPOLLRDHUP | (c->want_out?(uint32_t)EPOLLOUT:0));
+	}
+}
+
+static void pub_client_event( void *arg, int fd, uint32_t events ) {
+	struct publisher_s *p = (struct publisher_s *)arg;
+	struct pub_client_s *c = NULL;
+
+	for (int i = 0; i < p->nclients; i++) {
+		if (p->clients[i].fd == fd) c = &(p->clients[i]);
+	}
+	if (!c) return;
+
+	if (events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP)) {
+		pub_drop(p, c);
+		return;
+	}
+
+	if (events & EPOLLIN) {
+		char b[256];
+		ssize_t sz = read(fd, b, sizeof(b));
+
+		if ((sz == 0)||((sz < 0)&&(errno != EAGAIN)&&(errno != EINTR))) {
+			pub_drop(p, c);
+			return;
+		}
+	}
+
+	if (events & EPOLLOUT) pub_write(p, c);
+}
+
+static void pub_accept( void *arg, int fd, uint32_t events ) {
+	struct publisher_s *p = (struct publisher_s *)arg;
+	(void)events;
+
+	for (;;) {
+		struct pub_client_s *c;
+		int cfd;
+
+		cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (cfd < 0) return;
+
+		c = pub_slot(p);
+		if (c) {
+			memset(c, 0, sizeof(*c));
+			c->fd = -1;
+			c->q = (char *)malloc(PUB_QUEUE_SIZE);
+			if (!c->q) errno = ENOMEM;
+		}
+		if ((!c)||(!c->q)||(engine_watch(p->engine, cfd, EPOLLIN | EPOLLRDHUP, pub_client_event, p) < 0)) {
+			fprintf(stdout,"Sample socket: subscriber refused (%s)\n", strerror(errno));
+			if (c) {
+				free(c->q);
+				c->q = NULL;
+			}
+			close(cfd);
+			p->refused++;
+			continue;
+		}
+		c->fd = cfd;
+		p->accepted++;
+
+		pub_queue(c, LOG_HEADER, sizeof(LOG_HEADER) -1);
+	}
+}
+
+/*
+ * Start listening on path (any stale socket there is
+ * replaced) and hook in to the engine
+ *
+ * Returns 0 on success, -1 with errno set
+ *
+ */
+int publisher_open( struct publisher_s *p, const char *path, struct engine_s *e ) {
+	struct sockaddr_un sa;
+
+	memset(p, 0, sizeof(*p));
+	p->fd = -1;
+	p->engine = e;
+
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", path);
+
+	p->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (p->fd < 0) return -1;
+
+	unlink(path);
+	if ((bind(p->fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+			|| (listen(p->fd, SOMAXCONN) < 0)
+			|| (engine_idle(e, publisher_flush, p) < 0)
+			|| (engine_watch(e, p->fd, EPOLLIN, pub_accept, p) < 0)) {
+		int err = errno;
+
+		close(p->fd);
+		p->fd = -1;
+		errno = err;
+		return -1;
+	}
+
+	p->path = strdup(path);
+
+	return 0;
+}
+
+/*
+ * Queue a sample for every subscriber, dropping it for any
+ * whose queue is full
+ *
+ */
+void publisher_sample( struct publisher_s *p, const struct sample_s *smp ) {
+	char b[LOG_LINE_MAX];
+	int n = -1;
+
+	for (int i = 0; i < p->nclients; i++) {
+		struct pub_client_s *c = &(p->clients[i]);
+
+		if (c->fd < 0) continue;
+		if (n < 0) n = logger_format(b, sizeof(b), smp);
+		if (!pub_queue(c, b, n)) c->dropped++;
+	}
+}
+
+/*
+ * engine idle hook, push out whatever was queued this pass
+ * to subscribers that aren't already waiting for EPOLLOUT
+ *
+ */
+void publisher_flush( void *arg ) {
+	struct publisher_s *p = (struct publisher_s *)arg;
+
+	for (int i = 0; i < p->nclients; i++) {
+		struct pub_client_s *c = &(p->clients[i]);
+
+		if ((c->fd < 0)||(c->want_out)||(c->head == c->tail)) continue;
+		pub_write(p, c);
+	}
+}
+
+/*
+ * Only once the engine has stopped
+ *
+ */
+void publisher_close( struct publisher_s *p ) {
+	if (p->fd < 0) return;
+
+	for (int i = 0; i < p->nclients; i++) {
+		if (p->clients[i].fd >= 0) pub_drop(p, &(p->clients[i]));
+	}
+	free(p->clients);
+	p->clients = NULL;
+	p->nclients = 0;
+
+	engine_unwatch(p->engine, p->fd);
+	close(p->fd);
+	p->fd = -1;
+	if (p->path) unlink(p->path);
+	free(p->path);
+	p->path = NULL;
+}
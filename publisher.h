@@ -0,0 +1,54 @@
+/*
+ * Multicomp MP7100  / OWON SP3051 / 3101 / 6031 / 5051
+ *
+ * Unix socket sample publisher
+ *
+ */
+
+#ifndef MP7100_PUBLISHER_H
+#define MP7100_PUBLISHER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "sample.h"
+#include "engine.h"
+
+#define PUB_CLIENTS_INITIAL 16 // the table doubles when it fills
+#define PUB_QUEUE_SIZE 65536 // bytes per subscriber, power of two
+
+/*
+ * Each subscriber gets its own bounded queue.  Writes are
+ * non-blocking and only happen from the engine thread, so a
+ * subscriber that can't keep up just fills its queue and then
+ * has samples dropped (and counted); acquisition and the
+ * other subscribers never wait on it.
+ *
+ */
+struct pub_client_s {
+	int fd; // -1 = free slot
+	char *q;
+	uint32_t head, tail; // free running, head -tail = bytes queued
+	bool want_out; // EPOLLOUT armed
+	uint64_t sent;
+	uint64_t dropped;
+};
+
+struct publisher_s {
+	int fd;
+	char *path;
+	struct engine_s *engine;
+	struct pub_client_s *clients;
+	int nclients;
+
+	uint64_t accepted;
+	uint64_t refused; // couldn't set up their queue
+	uint64_t dropped; // samples, summed over subscribers that have gone
+};
+
+int publisher_open( struct publisher_s *p, const char *path, struct engine_s *e );
+void publisher_sample( struct publisher_s *p, const struct sample_s *smp );
+void publisher_flush( void *arg );
+void publisher_close( struct publisher_s *p );
+
+#endif
@@ -0,0 +1,662 @@
+/*
+ * Multicomp MP7100  / OWON SP3051 / 3101 / 6031 / 5051
+ *
+ * Timed setpoint profiles
+ *
+ * A profile is a text file, one step per line, '#' to the
+ * end of a line is a comment
+ *
+ *   device <n>                     which -p it drives, default 0
+ *   volt <V>                       set the voltage
+ *   curr <A>                       set the current limit
+ *   output on|off
+ *   wait <time>                    hold
+ *   ramp volt|curr <from> <to> <time> [every <time>]
+ *   cc <A> <V> [until v|a >=|<= <value>] [for <time>]
+ *   cv <V> <A> [until v|a >=|<= <value>] [for <time>]
+ *   wait until v|a >=|<= <value> [for <time>]
+ *   repeat [<n>]                   run it all <n> times, forever if not given
+ *
+ * Times are seconds unless they end in ms, s, m or h.  A cc
+ * stage sets the current and then the voltage limit, cv the
+ * other way about; either then waits for its cutoff (checked
+ * against every sample) or its time, whichever comes first.
+ * A ramp moves the setpoint in a straight line, a new value
+ * every 100ms unless told otherwise.  For example a Li-ion
+ * charge
+ *
+ *   output off
+ *   cc 1.0 4.2 until v >= 4.19 for 2h
+ *   output on
+ *   cv 4.2 1.0 until a <= 0.05 for 1h
+ *   output off
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/timerfd.h>
+
+#include "ramp.h"
+
+#define RAMP_MAX_TOKENS 12
+
+/*
+ * "250ms", "1.5s", "10m", "2h", or plain seconds
+ *
+ * Returns 0 on success, -1 if it isn't a time
+ *
+ */
+static int ramp_time( const char *s, uint64_t *us ) {
+	char b[32];
+	size_t n = strlen(s);
+	int64_t v;
+	uint64_t div = 1, mult = 1;
+
+	if ((n == 0)||(n >= sizeof(b))) return -1;
+	memcpy(b, s, n +1);
+
+	if ((n > 2) && (strcmp(b +n -2, "ms") == 0)) { div = 1000; b[n -2] = '\0'; }
+	else if (b[n -1] == 's') b[n -1] = '\0';
+	else if (b[n -1] == 'm') { mult = 60; b[n -1] = '\0'; }
+	else if (b[n -1] == 'h') { mult = 3600; b[n -1] = '\0'; }
+
+	/* seconds in micro units is microseconds */
+	if ((parse_micro(b, &v) < 0)||(v < 0)) return -1;
+	*us = (uint64_t)v *mult /div;
+
+	return 0;
+}
+
+#define RAMP_USAGE_DEVICE "expected device <n>"
+#define RAMP_USAGE_VOLT "expected volt <V>"
+#define RAMP_USAGE_CURR "expected curr <A>"
+#define RAMP_USAGE_OUTPUT "expected output on|off"
+#define RAMP_USAGE_WAIT "expected wait <time>, or wait until v|a >=|<= <value> [for <time>]"
+#define RAMP_USAGE_CC "expected cc <A> <V> [until v|a >=|<= <value>] [for <time>]"
+#define RAMP_USAGE_CV "expected cv <V> <A> [until v|a >=|<= <value>] [for <time>]"
+#define RAMP_USAGE_RAMP "expected ramp volt|curr <from> <to> <time> [every <time>]"
+#define RAMP_USAGE_REPEAT "expected repeat [<n>]"
+
+/*
+ * The "until ..." and "for ..." that can end a wait, cc or cv
+ * line, from tok[i] on, anything else gets usage
+ *
+ * Returns 0 on success, -1 with *why set
+ *
+ */
+static int ramp_stage_options( struct ramp_step_s *st, char **tok, int n, int i, const char *usage, const char **why ) {
+	while (i < n) {
+		if ((strcmp(tok[i], "for") == 0) && (i +1 < n)) {
+			if (ramp_time(tok[i +1], &(st->time)) < 0) {
+				*why = "bad time";
+				return -1;
+			}
+			i += 2;
+			continue;
+		}
+
+		if ((strcmp(tok[i], "until") == 0) && (i +3 < n)) {
+			if (strcmp(tok[i +1], "v") == 0) st->cut_what = CTL_VOLT;
+			else if (strcmp(tok[i +1], "a") == 0) st->cut_what = CTL_CURR;
+			else {
+				*why = "until takes v or a";
+				return -1;
+			}
+			if (strcmp(tok[i +2], ">=") == 0) st->cut_above = true;
+			else if (strcmp(tok[i +2], "<=") == 0) st->cut_above = false;
+			else {
+				*why = "until takes >= or <=";
+				return -1;
+			}
+			if (parse_micro(tok[i +3], &(st->cut)) < 0) {
+				*why = "bad cutoff value";
+				return -1;
+			}
+			i += 4;
+			continue;
+		}
+
+		*why = usage;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * One line in to st
+ *
+ * Returns 1 for a step, 0 for a line with nothing to do,
+ * -1 with *why set
+ *
+ */
+static int ramp_parse( struct ramp_s *r, char *line, struct ramp_step_s *st, const char **why ) {
+	char *tok[RAMP_MAX_TOKENS], *save = NULL, *p;
+	int n = 0;
+
+	p = strchr(line, '#');
+	if (p) *p = '\0';
+	for (char *t = strtok_r(line, " \t\r\n", &save); t; t = strtok_r(NULL, " \t\r\n", &save)) {
+		if (n == RAMP_MAX_TOKENS) {
+			*why = "too many words";
+			return -1;
+		}
+		tok[n++] = t;
+	}
+	if (n == 0) return 0;
+
+	st->cut_what = -1;
+
+	if (strcmp(tok[0], "device") == 0) {
+		if (n != 2) {
+			*why = RAMP_USAGE_DEVICE;
+			return -1;
+		}
+		r->dev = atoi(tok[1]);
+		return 0;
+	}
+
+	if ((strcmp(tok[0], "volt") == 0)||(strcmp(tok[0], "curr") == 0)) {
+		st->op = (tok[0][0] == 'v')?RAMP_VOLT:RAMP_CURR;
+		if (n != 2) {
+			*why = (st->op == RAMP_VOLT)?RAMP_USAGE_VOLT:RAMP_USAGE_CURR;
+			return -1;
+		}
+		if ((parse_micro(tok[1], &(st->a)) < 0)||(st->a < 0)) {
+			*why = "bad value";
+			return -1;
+		}
+		return 1;
+	}
+
+	if (strcmp(tok[0], "output") == 0) {
+		st->op = RAMP_OUTPUT;
+		if (n != 2) {
+			*why = RAMP_USAGE_OUTPUT;
+			return -1;
+		}
+		if (strcmp(tok[1], "on") == 0) st->a = 1;
+		else if (strcmp(tok[1], "off") == 0) st->a = 0;
+		else {
+			*why = "output takes on or off";
+			return -1;
+		}
+		return 1;
+	}
+
+	if (strcmp(tok[0], "wait") == 0) {
+		st->op = RAMP_WAIT;
+		if (n == 1) {
+			*why = RAMP_USAGE_WAIT;
+			return -1;
+		}
+		if ((strcmp(tok[1], "until") != 0) && (strcmp(tok[1], "for") != 0)) {
+			if (n != 2) {
+				*why = RAMP_USAGE_WAIT;
+				return -1;
+			}
+			if (ramp_time(tok[1], &(st->time)) < 0) {
+				*why = "bad time";
+				return -1;
+			}
+			return 1;
+		}
+		if (ramp_stage_options(st, tok, n, 1, RAMP_USAGE_WAIT, why) < 0) return -1;
+		if ((st->time == 0) && (st->cut_what < 0)) {
+			*why = "wait needs a time or a cutoff";
+			return -1;
+		}
+		return 1;
+	}
+
+	if ((strcmp(tok[0], "cc") == 0)||(strcmp(tok[0], "cv") == 0)) {
+		const char *usage;
+
+		st->op = (tok[0][1] == 'c')?RAMP_CC:RAMP_CV;
+		usage = (st->op == RAMP_CC)?RAMP_USAGE_CC:RAMP_USAGE_CV;
+		if (n < 3) {
+			*why = usage;
+			return -1;
+		}
+		if ((parse_micro(tok[1], &(st->a)) < 0)||(parse_micro(tok[2], &(st->b)) < 0)||(st->a < 0)||(st->b < 0)) {
+			*why = "bad value";
+			return -1;
+		}
+		return (ramp_stage_options(st, tok, n, 3, usage, why) < 0)?-1:1;
+	}
+
+	if (strcmp(tok[0], "ramp") == 0) {
+		st->op = RAMP_RAMP;
+		if ((n != 5) && ((n != 7)||(strcmp(tok[5], "every") != 0))) {
+			*why = RAMP_USAGE_RAMP;
+			return -1;
+		}
+		if (strcmp(tok[1], "volt") == 0) st->what = CTL_VOLT;
+		else if (strcmp(tok[1], "curr") == 0) st->what = CTL_CURR;
+		else {
+			*why = "ramp takes volt or curr";
+			return -1;
+		}
+		if ((parse_micro(tok[2], &(st->a)) < 0)||(parse_micro(tok[3], &(st->b)) < 0)||(st->a < 0)||(st->b < 0)) {
+			*why = "bad value";
+			return -1;
+		}
+		st->every = RAMP_EVERY_DEFAULT;
+		if ((ramp_time(tok[4], &(st->time)) < 0)||((n == 7) && (ramp_time(tok[6], &(st->every)) < 0))) {
+			*why = "bad time";
+			return -1;
+		}
+		if (st->time == 0) {
+			*why = "a ramp takes time";
+			return -1;
+		}
+		if (st->every == 0) {
+			*why = "every must be > 0";
+			return -1;
+		}
+		if (st->every > st->time) {
+			*why = "every must be no longer than the ramp";
+			return -1;
+		}
+		return 1;
+	}
+
+	if (strcmp(tok[0], "repeat") == 0) {
+		st->op = RAMP_REPEAT;
+		if (n > 2) {
+			*why = RAMP_USAGE_REPEAT;
+			return -1;
+		}
+		st->count = (n == 2)?atoi(tok[1]):0;
+		if (st->count < 0) {
+			*why = "bad count";
+			return -1;
+		}
+		return 1;
+	}
+
+	*why = "unknown step";
+	return -1;
+}
+
+/*
+ * Read and check a profile, before anything is opened
+ *
+ * Returns 0 on success, -1 (having said why) if it can't be
+ * read or is wrong
+ *
+ */
+int ramp_load( struct ramp_s *r, const char *path ) {
+	char line[256];
+	FILE *f;
+	int ln = 0;
+	bool timed = false;
+
+	r->steps = NULL;
+	r->nsteps = 0;
+	r->dev = 0;
+	r->engine = NULL;
+	r->control = NULL;
+	r->tfd = -1;
+	r->armed = 0;
+	r->cur = 0;
+	r->entered = false;
+	r->at = 0;
+	r->k = 0;
+	r->repeats = 0;
+	for (int i = 0; i < 3; i++) {
+		r->have[i] = false;
+		r->value[i] = 0;
+	}
+	r->resend = false;
+	r->done = false;
+	r->changes = 0;
+	perf_hist_reset(&(r->late));
+
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stdout,"Error opening ramp profile [%s] : %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	r->steps = (struct ramp_step_s *)calloc(RAMP_MAX_STEPS, sizeof(struct ramp_step_s));
+	if (!r->steps) {
+		fclose(f);
+		fprintf(stdout,"Error loading ramp profile [%s] : %s\n", path, strerror(ENOMEM));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		struct ramp_step_s *st = &(r->steps[r->nsteps]);
+		const char *why = NULL;
+		int rc;
+
+		ln++;
+		if (r->nsteps == RAMP_MAX_STEPS) {
+			why = "too many steps";
+		} else if ((r->nsteps > 0) && (r->steps[r->nsteps -1].op == RAMP_REPEAT)) {
+			if (ramp_parse(r, line, st, &why) == 1) why = "repeat has to be the last step";
+		} else {
+			rc = ramp_parse(r, line, st, &why);
+			if (rc == 1) {
+				st->line = ln;
+				if ((st->op == RAMP_WAIT)||(st->op == RAMP_RAMP)||(st->time)||(st->cut_what >= 0)) timed = true;
+				if ((st->op == RAMP_REPEAT) && (!timed)) why = "repeat of steps that take no time";
+				r->nsteps++;
+			}
+		}
+
+		if (why) {
+			fprintf(stdout,"%s:%d: %s\n", path, ln, why);
+			fclose(f);
+			free(r->steps);
+			r->steps = NULL;
+			return -1;
+		}
+	}
+	fclose(f);
+
+	if (r->nsteps == 0) {
+		fprintf(stdout,"%s: No steps in the ramp profile\n", path);
+		free(r->steps);
+		r->steps = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void ramp_arm( struct ramp_s *r, uint64_t t ) {
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = t /1000000;
+	its.it_value.tv_nsec = (t %1000000) *1000;
+	timerfd_settime(r->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+	r->armed = t;
+}
+
+static void ramp_disarm( struct ramp_s *r ) {
+	struct itimerspec its;
+
+	if (!r->armed) return;
+	memset(&its, 0, sizeof(its));
+	timerfd_settime(r->tfd, 0, &its, NULL);
+	r->armed = 0;
+}
+
+static void ramp_stop( struct ramp_s *r ) {
+	ramp_disarm(r);
+	r->done = true;
+}
+
+/*
+ * Queue a change, due at deadline.  If the supply is offline
+ * it's only remembered, and sent once it's back.
+ *
+ * Returns 0 on success, -1 if the profile had to stop
+ *
+ */
+static int ramp_set( struct ramp_s *r, int what, int64_t value, uint64_t deadline ) {
+	struct ctl_cmd_s cmd;
+	const char *why;
+
+	r->have[what] = true;
+	r->value[what] = value;
+	if (r->resend) return 0;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.dev = r->dev;
+	cmd.what = what;
+	cmd.how = CTL_SET;
+	cmd.value = value;
+	cmd.posted = deadline;
+	if (control_apply(r->control, &cmd, &why) < 0) {
+		fprintf(stdout,"Ramp profile stopped at line %d, %s\n", r->steps[r->cur].line, why);
+		ramp_stop(r);
+		return -1;
+	}
+	r->changes++;
+
+	return 0;
+}
+
+static void ramp_next( struct ramp_s *r ) {
+	r->cur++;
+	r->entered = false;
+}
+
+/*
+ * Run steps until one has to wait for its deadline or a
+ * cutoff
+ *
+ */
+static void ramp_run( struct ramp_s *r, uint64_t now ) {
+	while (!r->done) {
+		struct ramp_step_s *st;
+
+		if (r->cur >= r->nsteps) {
+			fprintf(stdout,"Ramp profile finished\n");
+			ramp_stop(r);
+			return;
+		}
+		st = &(r->steps[r->cur]);
+
+		switch (st->op) {
+			case RAMP_VOLT:
+			case RAMP_CURR:
+				if (ramp_set(r, (st->op == RAMP_VOLT)?CTL_VOLT:CTL_CURR, st->a, r->at) < 0) return;
+				ramp_next(r);
+				continue;
+
+			case RAMP_OUTPUT:
+				if (ramp_set(r, CTL_OUTPUT, st->a, r->at) < 0) return;
+				ramp_next(r);
+				continue;
+
+			case RAMP_REPEAT:
+				r->repeats++;
+				if (st->count && (r->repeats >= st->count)) {
+					ramp_next(r);
+				} else {
+					r->cur = 0;
+					r->entered = false;
+				}
+				continue;
+
+			case RAMP_RAMP:
+				{
+					uint64_t end = r->at +st->time;
+					uint64_t t;
+
+					if (!r->entered) {
+						r->entered = true;
+						r->k = 0;
+					}
+
+					t = r->at +r->k *st->every;
+					if (t > end) t = end;
+					if (now < t) {
+						ramp_arm(r, t);
+						return;
+					}
+
+					/* behind, the only setpoint worth sending is the latest due */
+					if (now >= t +st->every) {
+						r->k = (now -r->at) /st->every;
+						t = r->at +r->k *st->every;
+						if (t > end) t = end;
+					}
+
+					if (ramp_set(r, st->what, st->a +(int64_t)((double)(st->b -st->a) *(t -r->at) /st->time), t) < 0) return;
+					if (t >= end) {
+						r->at = end;
+						ramp_next(r);
+					} else {
+						r->k++;
+					}
+				}
+				continue;
+
+			case RAMP_CC:
+			case RAMP_CV:
+			case RAMP_WAIT:
+				if (!r->entered) {
+					r->entered = true;
+					if (st->op == RAMP_CC) {
+						if ((ramp_set(r, CTL_CURR, st->a, r->at) < 0)||(ramp_set(r, CTL_VOLT, st->b, r->at) < 0)) return;
+					} else if (st->op == RAMP_CV) {
+						if ((ramp_set(r, CTL_VOLT, st->a, r->at) < 0)||(ramp_set(r, CTL_CURR, st->b, r->at) < 0)) return;
+					}
+				}
+
+				if ((st->time == 0) && (st->cut_what < 0)) {
+					ramp_next(r);
+					continue;
+				}
+				if (st->time && (now >= r->at +st->time)) {
+					r->at += st->time;
+					ramp_next(r);
+					continue;
+				}
+
+				if (st->time) ramp_arm(r, r->at +st->time);
+				else ramp_disarm(r);
+				return;
+		}
+	}
+}
+
+static void ramp_timer( void *arg, int fd, uint32_t events ) {
+	struct ramp_s *r = (struct ramp_s *)arg;
+	uint64_t n, now = monotonic_us();
+	(void)events;
+
+	if (read(fd, &n, sizeof(n)) < 0) return;
+
+	if (r->armed) {
+		perf_hist_add(&(r->late), (now > r->armed)?now -r->armed:0);
+		r->armed = 0;
+	}
+	ramp_run(r, now);
+}
+
+/*
+ * Start driving the supply, from the engine's thread (or
+ * before it runs)
+ *
+ * Returns 0 on success, -1 with errno set
+ *
+ */
+int ramp_start( struct ramp_s *r, struct engine_s *e, struct control_s *c ) {
+	if ((r->dev < 0)||(r->dev >= e->ndev)) {
+		errno = ENODEV;
+		return -1;
+	}
+	r->engine = e;
+	r->control = c;
+
+	r->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (r->tfd < 0) return -1;
+	if (engine_watch(e, r->tfd, EPOLLIN, ramp_timer, r) < 0) {
+		int err = errno;
+
+		close(r->tfd);
+		r->tfd = -1;
+		errno = err;
+		return -1;
+	}
+
+	r->at = monotonic_us();
+	ramp_run(r, r->at);
+
+	return 0;
+}
+
+/*
+ * The supply is back, send it the latest of everything the
+ * profile has set, now
+ *
+ */
+static void ramp_resend( struct ramp_s *r ) {
+	uint64_t now = monotonic_us();
+
+	r->resend = false;
+	fprintf(stdout,"Ramp profile: device %d is back, sending its settings again\n", r->dev);
+
+	/* output last, so it comes on (if it does) with the right limits */
+	if (r->have[CTL_CURR] && (ramp_set(r, CTL_CURR, r->value[CTL_CURR], now) < 0)) return;
+	if (r->have[CTL_VOLT] && (ramp_set(r, CTL_VOLT, r->value[CTL_VOLT], now) < 0)) return;
+	if (r->have[CTL_OUTPUT]) ramp_set(r, CTL_OUTPUT, r->value[CTL_OUTPUT], now);
+}
+
+/*
+ * Every sample, from the engine's on_sample, ends the current
+ * stage if it meets the stage's cutoff
+ *
+ */
+void ramp_sample( struct ramp_s *r, const struct sample_s *smp ) {
+	struct ramp_step_s *st;
+	struct device_s *d;
+	int64_t v;
+
+	if (r->done || (smp->dev != r->dev)) return;
+
+	/*
+	 * Going offline threw away whatever we still had queued,
+	 * and a power cycled supply has lost the rest.  The profile
+	 * keeps time meanwhile, with no readings no cutoff is met.
+	 *
+	 */
+	if (smp->flags & SAMPLE_OFFLINE) {
+		if (!r->resend) fprintf(stdout,"Ramp profile: device %d offline, its settings will be sent again when it's back\n", r->dev);
+		r->resend = true;
+		return;
+	}
+	if (smp->flags & SAMPLE_ERROR) return;
+
+	/* the first reading since it came back was taken before they went */
+	if (r->resend) {
+		ramp_resend(r);
+		return;
+	}
+
+	st = &(r->steps[r->cur]);
+	if ((!r->entered) || (st->cut_what < 0)) return;
+	if ((st->op != RAMP_WAIT) && (st->op != RAMP_CC) && (st->op != RAMP_CV)) return;
+
+	/*
+	 * The stage's settings haven't reached the supply yet.  A
+	 * reading in flight when they were queued ends here too,
+	 * they go out before the next one starts.
+	 *
+	 */
+	d = &(r->engine->devices[r->dev]);
+	if (d->npending) return;
+
+	v = (st->cut_what == CTL_VOLT)?smp->uv:smp->ua;
+	if (st->cut_above?(v < st->cut):(v > st->cut)) return;
+
+	fprintf(stdout,"Ramp profile line %d: cutoff reached after %.1fs\n", st->line, (smp->t_us -r->at) /1000000.0);
+	r->at = smp->t_us;
+	ramp_next(r);
+	ramp_run(r, monotonic_us());
+}
+
+/*
+ * Only once the engine has stopped
+ *
+ */
+void ramp_close( struct ramp_s *r ) {
+	if (r->tfd >= 0) {
+		engine_unwatch(r->engine, r->tfd);
+		close(r->tfd);
+		r->tfd = -1;
+	}
+	free(r->steps);
+	r->steps = NULL;
+}
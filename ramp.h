@@ -0,0 +1,89 @@
+/*
+ * Multicomp MP7100  / OWON SP3051 / 3101 / 6031 / 5051
+ *
+ * Timed setpoint profiles (-x), steps, ramps and CC/CV stages
+ *
+ */
+
+#ifndef MP7100_RAMP_H
+#define MP7100_RAMP_H
+
+#include <stdint.h>
+
+#include "engine.h"
+#include "control.h"
+#include "perf.h"
+
+#define RAMP_MAX_STEPS 1024
+#define RAMP_EVERY_DEFAULT 100000 // us between the setpoints of a ramp
+
+#define RAMP_VOLT 0 // set the voltage
+#define RAMP_CURR 1 // set the current limit
+#define RAMP_OUTPUT 2
+#define RAMP_WAIT 3 // for a time, a cutoff, or whichever comes first
+#define RAMP_RAMP 4 // linear, from -> to over time
+#define RAMP_CC 5 // current then voltage limit, then as RAMP_WAIT
+#define RAMP_CV 6 // voltage then current limit, then as RAMP_WAIT
+#define RAMP_REPEAT 7 // back to the first step
+
+struct ramp_step_s {
+	int op;
+	int line;
+	int what; // CTL_VOLT / CTL_CURR, what a RAMP_RAMP changes
+	int64_t a, b; // uV / uA: the value, from/to, or CC/CV setting/limit
+	uint64_t time; // us, ramp duration or stage timeout (0 = none)
+	uint64_t every; // us between ramp setpoints
+	int cut_what; // -1 no cutoff, else CTL_VOLT / CTL_CURR of the measurement
+	bool cut_above; // ends once the reading is >= cut (else <=)
+	int64_t cut;
+	int count; // RAMP_REPEAT, times round again, 0 = forever
+};
+
+/*
+ * The steps run on the engine thread, off a timerfd armed
+ * with absolute deadlines: each stage is due when the one
+ * before it was due to end, never when it happened to, so
+ * lateness doesn't accumulate over a long profile.  Stages
+ * with cutoffs end on the sample that meets them.
+ *
+ * Changes go through the control slots with the deadline as
+ * their post time, so the device's command latency (-P) is
+ * how late each setpoint actually reached the supply, and
+ * late is how late the timer woke us.
+ *
+ * While the supply is offline the profile carries on, and
+ * once it's back it's sent the latest of each setting again,
+ * see ramp_sample().
+ *
+ */
+struct ramp_s {
+	struct ramp_step_s *steps;
+	int nsteps;
+	int dev; // index of the supply it drives
+
+	struct engine_s *engine;
+	struct control_s *control;
+	int tfd; // -1 until started
+	uint64_t armed; // deadline the timer is set for, 0 = none
+
+	int cur; // step being run
+	bool entered; // its settings have been queued
+	uint64_t at; // when the current step was due to start
+	uint64_t k; // ramp: next setpoint's index
+	int repeats;
+
+	bool have[3]; // by CTL_VOLT / CTL_CURR / CTL_OUTPUT, the profile has set it
+	int64_t value[3]; // to this
+	bool resend; // the supply went offline, it needs them all again
+
+	bool done;
+	uint64_t changes; // setpoint / output changes queued
+	struct perf_hist_s late; // us each timer wake-up was behind its deadline
+};
+
+int ramp_load( struct ramp_s *r, const char *path );
+int ramp_start( struct ramp_s *r, struct engine_s *e, struct control_s *c );
+void ramp_sample( struct ramp_s *r, const struct sample_s *smp );
+void ramp_close( struct ramp_s *r );
+
+#endif
@@ -0,0 +1,263 @@
+/*
+ * Multicomp MP7100  / OWON SP3051 / 3101 / 6031 / 5051
+ *
+ * Replay of a raw transport capture
+ *
+ * The engine, parsing, statistics, logging and display run
+ * exactly as they would against the real supplies, only the
+ * far end of each device is this thread working through the
+ * capture: every CAP_TX record waits for the engine to send
+ * its query, every CAP_RX record is sent back as the
+ * device's answer.
+ *
+ * At real speed each answer comes back after the same delay
+ * it took in the capture (measured from the query it
+ * followed), so latencies, timeouts and the time based
+ * statistics all come out as they were.  In fast mode
+ * answers go back immediately and the engine is told to
+ * ignore its intervals, which benchmarks everything but the
+ * I/O.
+ *
+ * The answers only mean anything while the engine asks what
+ * it asked in the capture, so the first query that differs
+ * (usually a different -a) ends the replay.
+ *
+ * At the end of the capture our ends are closed, the engine
+ * sees the devices go (after taking whatever was still in
+ * flight) and, being replays, doesn't reopen them.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "replay.h"
+
+/*
+ * Read the capture's header
+ *
+ * Returns 0 on success, -1 with errno set (EINVAL if it isn't
+ * a capture)
+ *
+ */
+int replay_open( struct replay_s *r, const char *path, bool fast ) {
+	char magic[CAP_MAGIC_SIZE];
+	uint16_t n;
+
+	memset(r, 0, sizeof(*r));
+	r->fast = fast;
+
+	r->f = fopen(path, "rb");
+	if (!r->f) return -1;
+
+	if ((fread(magic, CAP_MAGIC_SIZE, 1, r->f) != 1)||(memcmp(magic, CAP_MAGIC, CAP_MAGIC_SIZE) != 0)
+			|| (fread(&n, sizeof(n), 1, r->f) != 1)||(n > REPLAY_MAX_DEVICES)) {
+		fclose(r->f);
+		r->f = NULL;
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (int i = 0; i < n; i++) {
+		struct replay_dev_s *rd = &(r->dev[i]);
+		uint8_t mode;
+		uint16_t len;
+
+		if ((fread(&mode, sizeof(mode), 1, r->f) != 1)||(fread(&len, sizeof(len), 1, r->f) != 1)) break;
+		rd->name = (char *)calloc(1, len +1);
+		if ((!rd->name)||((len > 0) && (fread(rd->name, len, 1, r->f) != 1))) break;
+		rd->comms_mode = mode;
+		rd->fd = -1;
+		r->ndev = i +1;
+	}
+
+	if (r->ndev != n) {
+		replay_close(r);
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Hand the engine its end of the device's socket pair in
+ * place of device_open()
+ *
+ * Returns 0 on success, -1 with errno set
+ *
+ */
+int replay_attach( struct replay_s *r, struct device_s *d ) {
+	struct replay_dev_s *rd;
+	int sv[2];
+
+	if (d->index >= r->ndev) {
+		errno = ENODEV;
+		return -1;
+	}
+	rd = &(r->dev[d->index]);
+
+	if (socketpair(AF_UNIX, ((rd->comms_mode == CMODE_USB)?SOCK_SEQPACKET:SOCK_STREAM) | SOCK_CLOEXEC, 0, sv) < 0) return -1;
+
+	rd->fd = sv[0];
+	d->fd = sv[1];
+	d->comms_mode = rd->comms_mode;
+	d->pollable = true;
+	d->replay = true;
+	rx_ring_reset(&(d->rx));
+	d->tx.state = TX_IDLE;
+
+	return 0;
+}
+
+/*
+ * Wait for the engine to send a query of n bytes (a single
+ * message for usbtmc)
+ *
+ * Returns the bytes received in to b, -1 on timeout, quit or
+ * the engine hanging up
+ *
+ */
+static ssize_t replay_expect( struct replay_s *r, struct replay_dev_s *rd, char *b, size_t n ) {
+	uint64_t deadline = monotonic_us() +REPLAY_TX_TIMEOUT;
+	size_t got = 0;
+
+	while (got < n) {
+		struct pollfd p = { rd->fd, POLLIN, 0 };
+		ssize_t sz;
+
+		if (r->quit->load(std::memory_order_relaxed)||(monotonic_us() >= deadline)) return -1;
+		if (poll(&p, 1, REPLAY_POLL) <= 0) continue;
+
+		sz = read(rd->fd, b +got, n -got);
+		if (sz <= 0) return -1;
+		got += sz;
+		if (rd->comms_mode == CMODE_USB) break;
+	}
+
+	return got;
+}
+
+static void replay_send( struct replay_dev_s *rd, const char *b, size_t n ) {
+	while (n) {
+		ssize_t sz = write(rd->fd, b, n);
+		if (sz < 0) {
+			if (errno == EINTR) continue;
+			return;
+		}
+		b += sz;
+		n -= sz;
+	}
+}
+
+static void replay_sleep_until( uint64_t t_us ) {
+	struct timespec ts;
+
+	ts.tv_sec = t_us /1000000;
+	ts.tv_nsec = (t_us %1000000) *1000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static void *replay_thread( void *arg ) {
+	struct replay_s *r = (struct replay_s *)arg;
+	char b[CAP_MAX_RECORD], q[CAP_MAX_RECORD];
+	uint64_t cap_t = 0;
+	uint64_t tx_cap[REPLAY_MAX_DEVICES] = { 0 }; // capture time of each device's last query
+	uint64_t tx_at[REPLAY_MAX_DEVICES] = { 0 }; // and when we actually got it
+	struct cap_rec_s rec;
+
+	while (!r->quit->load(std::memory_order_relaxed)) {
+		struct replay_dev_s *rd;
+
+		if (fread(&rec, sizeof(rec), 1, r->f) != 1) break;
+		if ((rec.len > sizeof(b))||((rec.len > 0) && (fread(b, rec.len, 1, r->f) != 1))) break;
+		cap_t += rec.dt_us;
+		if ((rec.dir == CAP_GAP)||(rec.dev >= r->ndev)) continue;
+		rd = &(r->dev[rec.dev]);
+		r->records++;
+
+		if (rec.dir == CAP_TX) {
+			ssize_t n;
+
+			/*
+			 * Setpoint and output commands came from the user, not
+			 * the engine, and have no answer to play back
+			 *
+			 */
+			if (!memchr(b, '?', rec.len)) continue;
+
+			n = replay_expect(r, rd, q, rec.len);
+			if (n < 0) {
+				if (!r->quit->load(std::memory_order_relaxed)) {
+					fprintf(stdout,"%s: Replay stopped, the engine never sent '%.*s'\n", rd->name, (int)strcspn(b, "\r\n"), b);
+				}
+				break;
+			}
+			if (((size_t)n != rec.len)||(memcmp(q, b, n) != 0)) {
+				fprintf(stdout,"%s: Replay stopped, sent '%.*s' where the capture had '%.*s' (replay with the same -a as the capture)\n"
+						, rd->name, (int)strcspn(q, "\r\n"), q, (int)strcspn(b, "\r\n"), b);
+				break;
+			}
+			tx_cap[rec.dev] = cap_t;
+			tx_at[rec.dev] = monotonic_us();
+			continue;
+		}
+
+		if ((!r->fast) && tx_at[rec.dev]) replay_sleep_until(tx_at[rec.dev] +(cap_t -tx_cap[rec.dev]));
+		replay_send(rd, b, rec.len);
+	}
+
+	fprintf(stdout,"Replay finished, %llu records\n", (unsigned long long)r->records);
+
+	for (int i = 0; i < r->ndev; i++) {
+		if (r->dev[i].fd >= 0) close(r->dev[i].fd);
+		r->dev[i].fd = -1;
+	}
+
+	return NULL;
+}
+
+/*
+ * Start playing the device end, every device must have been
+ * attached
+ *
+ * Returns 0 on success, -1 with errno set
+ *
+ */
+int replay_start( struct replay_s *r, std::atomic<bool> *quit ) {
+	int e;
+
+	r->quit = quit;
+	e = pthread_create(&(r->tid), NULL, replay_thread, r);
+	if (e) {
+		errno = e;
+		return -1;
+	}
+	r->running = true;
+
+	return 0;
+}
+
+/*
+ * Only once quit is set, or the capture has played out
+ *
+ */
+void replay_close( struct replay_s *r ) {
+	if (r->running) pthread_join(r->tid, NULL);
+	r->running = false;
+
+	for (int i = 0; i < r->ndev; i++) {
+		if (r->dev[i].fd >= 0) close(r->dev[i].fd);
+		r->dev[i].fd = -1;
+		free(r->dev[i].name);
+		r->dev[i].name = NULL;
+	}
+	if (r->f) fclose(r->f);
+	r->f = NULL;
+}
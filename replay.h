@@ -0,0 +1,54 @@
+/*
+ * Multicomp MP7100  / OWON SP3051 / 3101 / 6031 / 5051
+ *
+ * Replay of a raw transport capture (-R / -RF)
+ *
+ */
+
+#ifndef MP7100_REPLAY_H
+#define MP7100_REPLAY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <pthread.h>
+
+#include "capture.h"
+#include "transport.h"
+
+#define REPLAY_MAX_DEVICES 64
+#define REPLAY_TX_TIMEOUT 5000000 // us we wait for the query a capture says comes next
+#define REPLAY_POLL 100 // ms, how often a waiting replay checks for quit
+
+/*
+ * Each device in the capture is handed to the engine as one
+ * end of a socket pair (a stream for serial, packets for
+ * usbtmc so messages keep their boundaries), the replay
+ * thread holds the other end and plays the device's part.
+ *
+ */
+struct replay_dev_s {
+	char *name;
+	int comms_mode;
+	int fd; // our end
+};
+
+struct replay_s {
+	FILE *f;
+	int ndev;
+	struct replay_dev_s dev[REPLAY_MAX_DEVICES];
+
+	bool fast; // no recorded delays, see replay_thread()
+	std::atomic<bool> *quit;
+	pthread_t tid;
+	bool running;
+
+	uint64_t records;
+};
+
+int replay_open( struct replay_s *r, const char *path, bool fast );
+int replay_attach( struct replay_s *r, struct device_s *d );
+int replay_start( struct replay_s *r, std::atomic<bool> *quit );
+void replay_close( struct replay_s *r );
+
+#endif
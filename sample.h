@@ -0,0 +1,100 @@
+/*
+ * Multicomp MP7100  / OWON SP3051 / 3101 / 6031 / 5051
+ *
+ * Samples and the ring the acquisition thread publishes
+ * them through.
+ *
+ */
+
+#ifndef MP7100_SAMPLE_H
+#define MP7100_SAMPLE_H
+
+#include <stdint.h>
+#include <atomic>
+
+/*
+ * One volts/amps reading as published by the acquisition
+ * thread.  t_us is CLOCK_MONOTONIC and wall_us CLOCK_REALTIME,
+ * both taken at the completion of the transaction.  Values
+ * are fixed point, see fixed.h; they're 0 when SAMPLE_ERROR
+ * is set and the other flags say why.
+ *
+ */
+#define SAMPLE_ERROR 0x0001
+#define SAMPLE_TIMEOUT 0x0002 // device didn't answer in time
+#define SAMPLE_NODATA 0x0004 // I/O error talking to it
+#define SAMPLE_BADVALUE 0x0008 // answered, but not with numbers
+#define SAMPLE_OFFLINE 0x0010 // device has gone, reconnecting
+
+struct sample_s {
+	uint64_t t_us;
+	uint64_t wall_us;
+	int64_t uv; // micro-volts
+	int64_t ua; // micro-amps
+	uint32_t seq;
+	uint16_t dev; // index of the device this came from
+	uint16_t flags;
+};
+
+/*
+ * What to show in place of the values of a failed sample
+ *
+ */
+static inline const char *sample_error_text( uint16_t flags ) {
+	if (flags & SAMPLE_OFFLINE) return "OFFLINE";
+	if (flags & SAMPLE_TIMEOUT) return "TIMEOUT";
+	if (flags & SAMPLE_BADVALUE) return "BADVALUE";
+	return "NODATA";
+}
+
+/*
+ * Lock-free single producer (acquisition thread) / single
+ * consumer (render loop) ring of samples, one per device.
+ *
+ * head is only written by the producer, tail only by the
+ * consumer, each on its own cache line.  If the consumer
+ * falls behind the producer drops the new sample rather
+ * than ever waiting on the UI.
+ *
+ */
+#define SAMPLE_RING_SIZE 256 // must be a power of two
+
+struct sample_ring_s {
+	alignas(64) std::atomic<uint32_t> head;
+	alignas(64) std::atomic<uint32_t> tail;
+	struct sample_s slot[SAMPLE_RING_SIZE];
+};
+
+/*
+ * Producer side of the sample ring
+ *
+ * Returns false (and drops the sample) if the ring is full
+ *
+ */
+static inline bool sample_ring_push( struct sample_ring_s *r, const struct sample_s *smp ) {
+	uint32_t head = r->head.load(std::memory_order_relaxed);
+
+	if (head -r->tail.load(std::memory_order_acquire) >= SAMPLE_RING_SIZE) return false;
+	r->slot[head & (SAMPLE_RING_SIZE -1)] = *smp;
+	r->head.store(head +1, std::memory_order_release);
+
+	return true;
+}
+
+/*
+ * Consumer side of the sample ring
+ *
+ * Returns false if there was nothing waiting
+ *
+ */
+static inline bool sample_ring_pop( struct sample_ring_s *r, struct sample_s *smp ) {
+	uint32_t tail = r->tail.load(std::memory_order_relaxed);
+
+	if (tail == r->head.load(std::memory_order_acquire)) return false;
+	*smp = r->slot[tail & (SAMPLE_RING_SIZE -1)];
+	r->tail.store(tail +1, std::memory_order_release);
+
+	return true;
+}
+
+#endif
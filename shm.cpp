@@ -0,0 +1,113 @@
+/*
+ * Multicomp MP7100  / OWON SP3051 / 3101 / 6031 / 5051
+ *
+ * Latest reading in POSIX shared memory, writer side
+ *
+ * Only ever called from the engine thread, so there's a
+ * single writer per slot and the seqlock needs no CAS.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "shm.h"
+#include "sample.h"
+
+/*
+ * Create (or take over) the segment and size it for ndev
+ * devices, nothing published yet
+ *
+ * Returns 0 on success, -1 with errno set
+ *
+ */
+int shm_writer_open( struct shm_writer_s *w, const char *name, uint32_t ndev ) {
+	size_t size = mp7100_shm_size(ndev);
+	void *p;
+	int fd;
+
+	w->name = NULL;
+	w->shm = NULL;
+
+	fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) return -1;
+	if (ftruncate(fd, size) < 0) {
+		int err = errno;
+
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) return -1;
+
+	/*
+	 * A reader attached to a previous run could be looking, so
+	 * clear the slots before saying what they are
+	 *
+	 */
+	w->shm = (struct mp7100_shm_s *)p;
+	for (uint32_t i = 0; i < ndev; i++) {
+		struct mp7100_shm_slot_s *s = &(w->shm->slot[i]);
+
+		s->lock.store(0, std::memory_order_relaxed);
+		s->seq.store(0, std::memory_order_relaxed);
+		s->t_us.store(0, std::memory_order_relaxed);
+		s->wall_us.store(0, std::memory_order_relaxed);
+		s->uv.store(0, std::memory_order_relaxed);
+		s->ua.store(0, std::memory_order_relaxed);
+		s->flags.store(0, std::memory_order_relaxed);
+	}
+	w->shm->ndev = ndev;
+	w->shm->slot_size = sizeof(struct mp7100_shm_slot_s);
+	w->shm->version = MP7100_SHM_VERSION;
+	std::atomic_thread_fence(std::memory_order_release);
+	w->shm->magic = MP7100_SHM_MAGIC;
+
+	w->name = strdup(name);
+
+	return 0;
+}
+
+/*
+ * Publish a sample as its device's latest reading
+ *
+ */
+void shm_writer_sample( struct shm_writer_s *w, const struct sample_s *smp ) {
+	struct mp7100_shm_slot_s *s;
+	uint32_t l;
+
+	if ((!w->shm)||(smp->dev >= w->shm->ndev)) return;
+	s = &(w->shm->slot[smp->dev]);
+
+	l = s->lock.load(std::memory_order_relaxed);
+	s->lock.store(l +1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	s->seq.store(smp->seq, std::memory_order_relaxed);
+	s->t_us.store(smp->t_us, std::memory_order_relaxed);
+	s->wall_us.store(smp->wall_us, std::memory_order_relaxed);
+	s->uv.store(smp->uv, std::memory_order_relaxed);
+	s->ua.store(smp->ua, std::memory_order_relaxed);
+	s->flags.store(smp->flags, std::memory_order_relaxed);
+
+	s->lock.store(l +2, std::memory_order_release);
+}
+
+/*
+ * Unmap and remove the name, readers still attached keep
+ * their (now frozen) mapping until they detach
+ *
+ */
+void shm_writer_close( struct shm_writer_s *w ) {
+	if (!w->shm) return;
+
+	munmap(w->shm, mp7100_shm_size(w->shm->ndev));
+	w->shm = NULL;
+	shm_unlink(w->name);
+	free(w->name);
+	w->name = NULL;
+}
@@ -0,0 +1,185 @@
+/*
+ * Multicomp MP7100  / OWON SP3051 / 3101 / 6031 / 5051
+ *
+ * Latest reading in POSIX shared memory
+ *
+ * With -m <name> the OSD keeps the most recent sample from
+ * every device in the shared memory object <name> (eg
+ * "/mp7100", see shm_overview(7)).  Each device's slot is
+ * guarded by a seqlock: the writer never waits on readers,
+ * and readers take a consistent snapshot with no syscalls
+ * and no coordination, so any number of them can poll it as
+ * often as they like without going near the supply.
+ *
+ * This header is all a reader needs:
+ *
+ *   struct mp7100_shm_s *shm = mp7100_shm_attach("/mp7100");
+ *   struct mp7100_reading_s r;
+ *
+ *   if (shm && mp7100_shm_read(shm, 0, &r) && !(r.flags & 1)) {
+ *       printf("%lld uV %lld uA\n", (long long)r.uv, (long long)r.ua);
+ *   }
+ *
+ */
+
+#ifndef MP7100_SHM_H
+#define MP7100_SHM_H
+
+#include <stdint.h>
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MP7100_SHM_MAGIC 0x3137504dU // "MP71"
+#define MP7100_SHM_VERSION 1
+#define MP7100_SHM_RETRIES 10000 // attempts at a consistent copy before giving up on the writer
+
+/*
+ * A snapshot as the reader gets it.  Same meaning as the
+ * fields of sample_s (sample.h): monotonic and wall clock us,
+ * micro-volts/amps, and flags bit 0 set if the latest
+ * transaction failed.  seq counts samples from the device.
+ *
+ */
+struct mp7100_reading_s {
+	uint64_t t_us;
+	uint64_t wall_us;
+	int64_t uv;
+	int64_t ua;
+	uint32_t seq;
+	uint16_t dev;
+	uint16_t flags;
+};
+
+/*
+ * One cache line per device.  lock is odd while the writer
+ * is part way through an update.  The payload is atomics
+ * only so the racy reads are well defined, they're all
+ * relaxed (plain loads/stores on anything we run on).
+ *
+ */
+struct alignas(64) mp7100_shm_slot_s {
+	std::atomic<uint32_t> lock;
+	std::atomic<uint32_t> seq;
+	std::atomic<uint64_t> t_us;
+	std::atomic<uint64_t> wall_us;
+	std::atomic<int64_t> uv;
+	std::atomic<int64_t> ua;
+	std::atomic<uint32_t> flags;
+};
+
+struct mp7100_shm_s {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t ndev;
+	uint32_t slot_size; // sizeof(struct mp7100_shm_slot_s) of the writer
+	struct mp7100_shm_slot_s slot[];
+};
+
+static inline size_t mp7100_shm_size( uint32_t ndev ) {
+	return sizeof(struct mp7100_shm_s) +ndev *sizeof(struct mp7100_shm_slot_s);
+}
+
+/*
+ * Map an existing segment read only
+ *
+ * Returns NULL if it isn't there or isn't one of ours
+ *
+ */
+static inline struct mp7100_shm_s *mp7100_shm_attach( const char *name ) {
+	struct mp7100_shm_s *shm;
+	struct stat st;
+	void *p;
+	int fd;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) return NULL;
+	if ((fstat(fd, &st) < 0)||((size_t)st.st_size < sizeof(struct mp7100_shm_s))) {
+		close(fd);
+		return NULL;
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) return NULL;
+
+	shm = (struct mp7100_shm_s *)p;
+	if ((shm->magic != MP7100_SHM_MAGIC)||(shm->version != MP7100_SHM_VERSION)
+			|| (shm->slot_size != sizeof(struct mp7100_shm_slot_s))
+			|| ((size_t)st.st_size < mp7100_shm_size(shm->ndev))) {
+		munmap(p, st.st_size);
+		return NULL;
+	}
+
+	return shm;
+}
+
+static inline void mp7100_shm_detach( struct mp7100_shm_s *shm ) {
+	munmap(shm, mp7100_shm_size(shm->ndev));
+}
+
+/*
+ * Consistent copy of device dev's latest reading
+ *
+ * Returns false if there's no such device or nothing has
+ * been published for it yet, or with errno EAGAIN if the slot
+ * stayed mid-update for MP7100_SHM_RETRIES attempts (the
+ * writer died part way through, or is badly starved)
+ *
+ */
+static inline bool mp7100_shm_read( const struct mp7100_shm_s *shm, uint32_t dev, struct mp7100_reading_s *r ) {
+	const struct mp7100_shm_slot_s *s;
+	uint32_t l0, l1;
+	int tries = 0;
+
+	if (dev >= shm->ndev) return false;
+	s = &(shm->slot[dev]);
+
+	do {
+		if (tries++ == MP7100_SHM_RETRIES) {
+			errno = EAGAIN;
+			return false;
+		}
+
+		l0 = s->lock.load(std::memory_order_acquire);
+		if (l0 & 1) {
+			/* let the writer finish, it may be waiting for this CPU */
+			sched_yield();
+			continue;
+		}
+
+		r->seq = s->seq.load(std::memory_order_relaxed);
+		r->t_us = s->t_us.load(std::memory_order_relaxed);
+		r->wall_us = s->wall_us.load(std::memory_order_relaxed);
+		r->uv = s->uv.load(std::memory_order_relaxed);
+		r->ua = s->ua.load(std::memory_order_relaxed);
+		r->flags = s->flags.load(std::memory_order_relaxed);
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		l1 = s->lock.load(std::memory_order_relaxed);
+	} while ((l0 & 1)||(l0 != l1));
+
+	r->dev = dev;
+
+	return (l0 != 0);
+}
+
+/*
+ * Writer side, see shm.cpp
+ *
+ */
+struct sample_s;
+
+struct shm_writer_s {
+	char *name;
+	struct mp7100_shm_s *shm;
+};
+
+int shm_writer_open( struct shm_writer_s *w, const char *name, uint32_t ndev );
+void shm_writer_sample( struct shm_writer_s *w, const struct sample_s *smp );
+void shm_writer_close( struct shm_writer_s *w );
+
+#endif
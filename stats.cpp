@@ -0,0 +1,85 @@
+/*
+ * Multicomp MP7100  / OWON SP3051 / 3101 / 6031 / 5051
+ *
+ * Running statistics, energy and charge
+ *
+ */
+
+#include <string.h>
+#include <math.h>
+
+#include "stats.h"
+#include "fixed.h"
+
+void stats_reset( struct stats_s *st ) {
+	memset(st, 0, sizeof(struct stats_s));
+}
+
+void stats_add( struct stats_s *st, const struct sample_s *smp ) {
+	double v, a;
+
+	if (smp->flags & SAMPLE_ERROR) {
+		st->have_prev = false;
+		return;
+	}
+
+	if (st->samples == 0) {
+		st->v_min = st->v_max = smp->uv;
+		st->a_min = st->a_max = smp->ua;
+		st->since = smp->t_us;
+	} else {
+		if (smp->uv < st->v_min) st->v_min = smp->uv;
+		if (smp->uv > st->v_max) st->v_max = smp->uv;
+		if (smp->ua < st->a_min) st->a_min = smp->ua;
+		if (smp->ua > st->a_max) st->a_max = smp->ua;
+	}
+	st->samples++;
+
+	v = (double)smp->uv /MICRO;
+	a = (double)smp->ua /MICRO;
+
+	if (st->have_prev && (smp->t_us > st->prev_t)) {
+		double dt = (smp->t_us -st->prev_t) /1000000.0;
+
+		st->span += dt;
+		st->v_int += (st->prev_v +v) *0.5 *dt;
+		st->v2_int += (st->prev_v *st->prev_v +v *v) *0.5 *dt;
+		st->a_int += (st->prev_a +a) *0.5 *dt;
+		st->a2_int += (st->prev_a *st->prev_a +a *a) *0.5 *dt;
+		st->p_int += (st->prev_v *st->prev_a +v *a) *0.5 *dt;
+	}
+
+	st->have_prev = true;
+	st->prev_t = smp->t_us;
+	st->prev_v = v;
+	st->prev_a = a;
+}
+
+/*
+ * Until there's a span to average over the only sample we
+ * have is the mean
+ *
+ */
+double stats_mean_v( const struct stats_s *st ) {
+	return (st->span > 0.0)?st->v_int /st->span:st->prev_v;
+}
+
+double stats_mean_a( const struct stats_s *st ) {
+	return (st->span > 0.0)?st->a_int /st->span:st->prev_a;
+}
+
+double stats_rms_v( const struct stats_s *st ) {
+	return (st->span > 0.0)?sqrt(st->v2_int /st->span):fabs(st->prev_v);
+}
+
+double stats_rms_a( const struct stats_s *st ) {
+	return (st->span > 0.0)?sqrt(st->a2_int /st->span):fabs(st->prev_a);
+}
+
+double stats_wh( const struct stats_s *st ) {
+	return st->p_int /3600.0;
+}
+
+double stats_ah( const struct stats_s *st ) {
+	return st->a_int /3600.0;
+}
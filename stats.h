@@ -0,0 +1,54 @@
+/*
+ * Multicomp MP7100  / OWON SP3051 / 3101 / 6031 / 5051
+ *
+ * Running statistics, energy and charge
+ *
+ */
+
+#ifndef MP7100_STATS_H
+#define MP7100_STATS_H
+
+#include <stdint.h>
+
+#include "sample.h"
+
+/*
+ * Everything is updated per sample in O(1) and fixed memory.
+ *
+ * Mean and RMS are time weighted: the trapezoidal integrals
+ * of v, v^2, i, i^2 and v*i are kept over the span covered,
+ * which is also what Ah and Wh are.  Sampling faster for a
+ * while (adaptive mode) doesn't skew them.
+ *
+ * A failed sample ends the current span, we don't integrate
+ * across a gap we know nothing about.
+ *
+ */
+struct stats_s {
+	uint64_t samples;
+	int64_t v_min, v_max; // uV
+	int64_t a_min, a_max; // uA
+
+	double span; // seconds integrated over
+	double v_int, v2_int; // V.s, V^2.s
+	double a_int, a2_int; // A.s (charge), A^2.s
+	double p_int; // W.s (energy)
+
+	bool have_prev;
+	uint64_t prev_t;
+	double prev_v, prev_a;
+
+	uint64_t since; // monotonic us of the first sample after a reset
+};
+
+void stats_reset( struct stats_s *st );
+void stats_add( struct stats_s *st, const struct sample_s *smp );
+
+double stats_mean_v( const struct stats_s *st );
+double stats_mean_a( const struct stats_s *st );
+double stats_rms_v( const struct stats_s *st );
+double stats_rms_a( const struct stats_s *st );
+double stats_wh( const struct stats_s *st );
+double stats_ah( const struct stats_s *st );
+
+#endif
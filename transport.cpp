@@ -0,0 +1,1225 @@
+/*
+ * Multicomp MP7100  / OWON SP3051 / 3101 / 6031 / 5051
+ *
+ * Device transport, USBTMC and serial, and the query/response
+ * transaction that turns them in to volts/amps readings.
+ *
+ * Everything here works on a single struct device_s, so the
+ * same code serves the blocking acquire() path as well as the
+ * epoll engine that multiplexes many devices.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#ifdef __linux__
+#include <linux/usb/tmc.h>
+#endif
+
+#include "transport.h"
+#include "models.h"
+#include "capture.h"
+
+/*
+ * Monotonic clock in microseconds, used for transaction
+ * deadlines so they're immune to wall clock changes
+ *
+ */
+uint64_t monotonic_us( void ) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec *1000000 + ts.tv_nsec /1000;
+}
+
+/*
+ * Wall clock in microseconds since the epoch, only for
+ * labelling samples, never for timing
+ *
+ */
+uint64_t realtime_us( void ) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec *1000000 + ts.tv_nsec /1000;
+}
+
+/*
+ * Wait until fd has data or the deadline passes
+ *
+ * Returns 1 if readable, 0 on timeout, -1 on error
+ *
+ */
+int wait_readable( int fd, uint64_t deadline ) {
+	struct pollfd pfd;
+	int r;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	do {
+		uint64_t now = monotonic_us();
+		int ms;
+
+		if (now >= deadline) return 0;
+		ms = (deadline -now +999) /1000;
+		r = poll(&pfd, 1, ms);
+	} while ((r == -1) && (errno == EINTR));
+
+	if (r < 0) return -1;
+	if (r == 0) return 0;
+	if (pfd.revents & (POLLERR|POLLNVAL)) return -1;
+	return 1;
+}
+
+/*
+ * Build the queries from the device's profile, serial needs
+ * them terminated, usbtmc is message based
+ *
+ */
+static void device_commands( struct device_s *d ) {
+	const struct model_profile_s *p = d->profile;
+	const char *term = (d->comms_mode == CMODE_SERIAL)?p->term:"";
+
+	snprintf(d->meas_volt,sizeof(d->meas_volt),"%s%s", p->meas_volt, term);
+	snprintf(d->meas_curr,sizeof(d->meas_curr),"%s%s", p->meas_curr, term);
+	snprintf(d->meas_compound,sizeof(d->meas_compound),"%s;%s%s", p->meas_volt, p->meas_curr, term);
+	snprintf(d->meas_all,sizeof(d->meas_all),"%s%s", p->meas_all, term);
+}
+
+/*
+ * Set up a device for the given path, the transport is
+ * picked from the name as it always has been
+ *
+ */
+void device_init( struct device_s *d, int index, char *path ) {
+	d->index = index;
+	d->device = path;
+	d->debug = false;
+	d->fd = -1;
+	d->pollable = true;
+	d->usb_wait = USB_WAIT_READ;
+	d->usb_probed = false;
+	d->serial_parameters_string = NULL;
+	d->serial_params.device = path;
+	d->serial_params.fd = -1;
+	rx_ring_reset(&(d->rx));
+	d->reader.started = false;
+	d->reader.efd = -1;
+	d->reader.quit = d->reader.want = d->reader.done = d->reader.busy = false;
+	pthread_mutex_init(&(d->reader.lock), NULL);
+	pthread_cond_init(&(d->reader.cond), NULL);
+
+	d->acq_mode = ACQ_COMPOUND;
+	d->io_timeout = IO_TIMEOUT_DEFAULT;
+	d->interval = 100000;
+	d->adapt.keepalive = 0;
+	d->adapt.dv = ADAPT_DV_DEFAULT;
+	d->adapt.di = ADAPT_DI_DEFAULT;
+	d->adapt.ref_t = 0;
+	d->adapt.fast_until = 0;
+
+	d->error_flag = false;
+	d->have_setpoints = false;
+	d->set_uv = d->set_ua = 0;
+	d->output = -1;
+	memset(d->pending, 0, sizeof(d->pending));
+	d->npending = 0;
+	perf_hist_reset(&(d->cmd_latency));
+	d->online = true;
+	d->reconnect_at = 0;
+	d->backoff = 0;
+	d->reconnects = 0;
+	d->timeouts = 0;
+	d->io_errors = 0;
+	perf_hist_reset(&(d->latency));
+
+	d->tx.state = TX_IDLE;
+	d->tx.start = 0;
+	d->next_due = 0;
+	d->period = 0;
+	d->overruns = 0;
+	d->seq = 0;
+
+	d->ring.head = 0;
+	d->ring.tail = 0;
+	d->ring_drops = 0;
+
+	d->capture = NULL;
+	d->replay = false;
+	d->comms_mode = strstr(path,"usbtmc")?CMODE_USB:CMODE_SERIAL;
+	d->profile = &model_profiles[0];
+	d->idn[0] = '\0';
+	device_commands(d);
+}
+
+/*
+ * Open the device handle
+ *
+ * Returns 0 on success, -1 with errno set
+ *
+ */
+int device_open( struct device_s *d ) {
+	if ( d->comms_mode == CMODE_SERIAL ) {
+		/*
+		 * handle the serial port
+		 *
+		 */
+		if (open_port( d ) != 0) return -1;
+
+	} else {
+		/*
+		 * Handle the USB port
+		 *
+		 */
+		d->fd = open( d->device, O_RDWR | O_CLOEXEC );
+		if (d->fd == -1) return -1;
+		usb_setup( d );
+	}
+
+	rx_ring_reset(&(d->rx));
+	d->tx.state = TX_IDLE;
+
+	return 0;
+}
+
+/*
+ * Does errno say the handle itself is dead (device unplugged,
+ * powered off, far end closed) rather than that one
+ * transaction went wrong?
+ *
+ */
+bool device_gone( int err ) {
+	switch (err) {
+		case ENODEV:
+		case ENXIO:
+		case ENOENT:
+		case EIO:
+		case EPIPE:
+		case EBADF:
+		case ESHUTDOWN:
+		case ECONNRESET:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/*
+ * One blocking query and its answer, for start up only
+ *
+ * Returns 0 on success, -1 with errno set
+ *
+ */
+static int device_ask( struct device_s *d, const char *query, char *b, ssize_t s ) {
+	char cmd[32];
+
+	snprintf(cmd, sizeof(cmd), "%s%s", query, (d->comms_mode == CMODE_SERIAL)?d->profile->term:"");
+	rx_ring_reset(&(d->rx));
+	if ((data_write(d, cmd, strlen(cmd)) < 0)||(data_read(d, b, s) < 0)) {
+		d->error_flag = false;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Ask the device what it is and pick its profile from the
+ * model field ("MANUFACTURER,MODEL,SERIAL,FIRMWARE")
+ *
+ * Blocks for up to io_timeout, so only for start up; a
+ * reopened device keeps the profile it had.
+ *
+ * Returns 0 if it answered (the profile may still be the
+ * generic one), -1 with errno set if it didn't
+ *
+ */
+int device_identify( struct device_s *d ) {
+	char b[TXN_RESP_SIZE];
+	char *model, *p;
+
+	if (device_ask(d, "*IDN?", b, sizeof(b)) < 0) return -1;
+	snprintf(d->idn, sizeof(d->idn), "%s", b);
+
+	model = strchr(b, ',');
+	model = model?model +1:b;
+	p = strchr(model, ',');
+	if (p) *p = '\0';
+
+	for (size_t i = 1; i < MODEL_PROFILES; i++) {
+		if (strcasestr(model, model_profiles[i].match)) {
+			d->profile = &model_profiles[i];
+			break;
+		}
+	}
+	device_commands(d);
+	rx_ring_reset(&(d->rx));
+
+	return 0;
+}
+
+/*
+ * Read the voltage and current setpoints and the output
+ * state, so relative changes (the arrow keys) have something
+ * to start from.  Blocking, start up only, after
+ * device_identify().
+ *
+ * Returns 0 on success, -1 with errno set if the device
+ * didn't answer (or not with numbers)
+ *
+ */
+int device_setpoints( struct device_s *d ) {
+	const struct model_profile_s *p = d->profile;
+	char q[24], b[TXN_RESP_SIZE];
+
+	snprintf(q, sizeof(q), "%s?", p->set_volt);
+	if (device_ask(d, q, b, sizeof(b)) < 0) return -1;
+	if (parse_micro(b, &(d->set_uv)) < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	snprintf(q, sizeof(q), "%s?", p->set_curr);
+	if (device_ask(d, q, b, sizeof(b)) < 0) return -1;
+	if (parse_micro(b, &(d->set_ua)) < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/*
+	 * "ON"/"OFF" or "1"/"0" depending on the firmware, not
+	 * knowing only matters to toggling it
+	 *
+	 */
+	snprintf(q, sizeof(q), "%s?", p->output);
+	if (device_ask(d, q, b, sizeof(b)) == 0) {
+		if ((strncasecmp(b, "ON", 2) == 0)||(b[0] == '1')) d->output = 1;
+		else if ((strncasecmp(b, "OFF", 3) == 0)||(b[0] == '0')) d->output = 0;
+	}
+	rx_ring_reset(&(d->rx));
+	d->have_setpoints = true;
+
+	return 0;
+}
+
+/*
+ * Send one setpoint or output command (CTL_SLOT_), these
+ * have no answer so nothing is waited for
+ *
+ * Returns 0 on success, -1 if the write failed
+ *
+ */
+int device_set( struct device_s *d, int slot, int64_t value ) {
+	const struct model_profile_s *p = d->profile;
+	const char *term = (d->comms_mode == CMODE_SERIAL)?p->term:"";
+	char cmd[64], v[32];
+
+	switch (slot) {
+		case CTL_SLOT_OFF:
+			snprintf(cmd, sizeof(cmd), "%s OFF%s", p->output, term);
+			break;
+		case CTL_SLOT_ON:
+			snprintf(cmd, sizeof(cmd), "%s ON%s", p->output, term);
+			break;
+		case CTL_SLOT_VOLT:
+			if (format_micro(v, sizeof(v), value, p->v_decimals, 0) < 0) return -1;
+			snprintf(cmd, sizeof(cmd), "%s %s%s", p->set_volt, v, term);
+			break;
+		case CTL_SLOT_CURR:
+			if (format_micro(v, sizeof(v), value, p->a_decimals, 0) < 0) return -1;
+			snprintf(cmd, sizeof(cmd), "%s %s%s", p->set_curr, v, term);
+			break;
+		default:
+			return -1;
+	}
+
+	return (data_write(d, cmd, strlen(cmd)) < 0)?-1:0;
+}
+
+void device_close( struct device_s *d ) {
+	if (d->fd >= 0) close(d->fd);
+	d->fd = -1;
+	d->serial_params.fd = -1;
+}
+
+/*
+ * Default parameters are 2400:8n1, given that the multimeter
+ * is shipped like this and cannot be changed then we shouldn't
+ * have to worry about needing to make changes, but we'll probably
+ * add that for future changes.
+ *
+ * Returns 0 on success, -1 with errno set if the port can't be
+ * opened.  Bad parameters are fatal.
+ *
+ */
+int open_port( struct device_s *d ) {
+#ifdef __linux__
+	struct serial_params_s *s = &(d->serial_params);
+	char *p = d->serial_parameters_string;
+	char default_params[] = "9600:8:n";
+	int r;
+
+	if (!p) p = default_params;
+
+	s->fd = open( s->device, O_RDWR | O_NOCTTY | O_NDELAY | O_CLOEXEC );
+	if (s->fd <0) return -1;
+
+	fcntl(s->fd,F_SETFL,0);
+	tcgetattr(s->fd,&(s->oldtp)); // save current serial port settings
+	tcgetattr(s->fd,&(s->newtp)); // save current serial port settings in to what will be our new settings
+	cfmakeraw(&(s->newtp));
+
+		s->newtp.c_cflag = CS8 |  CLOCAL | CREAD ;
+
+      if (strncmp(p, "115200:", 7) == 0) s->newtp.c_cflag |= B115200;
+		else if (strncmp(p, "57600:", 6) == 0) s->newtp.c_cflag |= B57600;
+		else if (strncmp(p, "38400:", 6) == 0) s->newtp.c_cflag |= B38400;
+		else if (strncmp(p, "19200:", 6) == 0) s->newtp.c_cflag |= B19200;
+		else if (strncmp(p, "9600:", 5) == 0) s->newtp.c_cflag |= B9600;
+		else if (strncmp(p, "4800:", 5) == 0) s->newtp.c_cflag |= B4800;
+      else if (strncmp(p, "2400:", 5) == 0) s->newtp.c_cflag |= B2400; //
+      else {
+         fprintf(stdout,"Invalid serial speed\r\n");
+         exit(1);
+      }
+
+		p = strchr(p,':');
+		if (p) {
+			p++;
+			// we don't do anything with the data bits because
+			// this PSU only accepts 8, so just jump to the next
+			// field
+			p = strchr(p,':');
+			if (!p) {
+				fprintf(stdout,"Invalid serial format string\n");
+				exit(1);
+			}
+      }
+
+      p++;
+      if (*p == 'o') s->newtp.c_cflag |= PARODD;
+      else if (*p == 'e') s->newtp.c_cflag |= PARENB;
+      else if (*p == 'n') s->newtp.c_cflag &= ~(PARODD|PARENB);
+      else {
+         fprintf(stdout,"Invalid serial parity type '%c'\r\n", *p);
+         exit(1);
+      }
+
+	s->newtp.c_iflag &= ~(IXON | IXOFF | IXANY );
+
+	/*
+	 * read() returns straight away with whatever is there,
+	 * waiting is done with poll() against the transaction
+	 * deadline so a silent device can't hang us
+	 *
+	 */
+	s->newtp.c_cc[VMIN] = 0;
+	s->newtp.c_cc[VTIME] = 0;
+
+	r = tcsetattr(s->fd, TCSANOW, &(s->newtp));
+	if (r) {
+		int err = errno;
+
+		fprintf(stderr,"%s:%d: Error setting terminal (%s)\n", FL, strerror(err));
+		close(s->fd);
+		s->fd = -1;
+		errno = err;
+		return -1;
+	}
+
+	/*
+	 * Don't let anything left over from a previous session
+	 * be taken as a response
+	 *
+	 */
+	tcflush(s->fd, TCIOFLUSH);
+
+	d->fd = s->fd;
+	d->pollable = true;
+#endif
+
+	return 0;
+}
+
+#ifdef __linux__
+/*
+ * See if the instrument will raise SRQ when it has an answer
+ * for us: enable the service request on MAV and ask it
+ * something.  The answer is read (and dropped) either way.
+ *
+ */
+static bool usb_srq_probe( struct device_s *d ) {
+	static const char sre[] = "*SRE 16";
+	static const char idn[] = "*IDN?";
+	char b[TXN_RESP_SIZE];
+	uint32_t ms = USBTMC_SRQ_PROBE;
+	bool srq;
+
+	if (write(d->fd, sre, sizeof(sre) -1) < 0) return false;
+	if (write(d->fd, idn, sizeof(idn) -1) < 0) return false;
+
+	srq = (ioctl(d->fd, USBTMC488_IOCTL_WAIT_SRQ, &ms) == 0);
+	if (read(d->fd, b, sizeof(b)) < 0) srq = false;
+
+	if (!srq) {
+		static const char off[] = "*SRE 0";
+		if (write(d->fd, off, sizeof(off) -1) < 0) return false;
+	}
+
+	return srq;
+}
+#endif
+
+/*
+ * Configure the USB handle after it's been opened.
+ *
+ * The usbtmc driver only raises POLLIN for its asynchronous
+ * ioctl API; a plain read() is what requests the data from the
+ * instrument.  For a real usbtmc node we therefore hand our
+ * transaction deadline to the driver and let read() do the
+ * waiting.  Anything else (pipes, sockets, test stand-ins) is
+ * waited on with poll().
+ *
+ * We also let the driver do as much as the instrument allows:
+ *
+ *   - the transfer ends at the '\n' (TermChar) so read()
+ *     returns as soon as the response is complete
+ *   - a read that times out is aborted in the kernel
+ *     (auto-abort), the next transaction starts clean
+ *   - anything left over from a previous session is cleared
+ *   - rather than a blind read (or the legacy settle delay)
+ *     we wait for SRQ on MAV, which epoll reports as
+ *     EPOLLPRI, or failing that poll the status byte
+ *
+ * Each of these is optional, whatever the instrument or
+ * driver doesn't support we simply go without.
+ *
+ * The SRQ probe can take USBTMC_SRQ_PROBE plus a read, so it's
+ * only done the first time.  A reopen (on the engine thread,
+ * see engine_reconnect()) keeps what it found and just turns
+ * the service request back on, a power cycle clears it.
+ *
+ */
+void usb_setup( struct device_s *d ) {
+	struct stat st;
+
+	d->pollable = true;
+	if ((fstat(d->fd, &st) != 0) || (!S_ISCHR(st.st_mode))) {
+		d->usb_wait = USB_WAIT_READ;
+		return;
+	}
+
+	d->pollable = false;
+#ifdef __linux__
+	uint32_t t = d->io_timeout;
+	struct usbtmc_termchar tc = { '\n', 1 };
+	uint8_t on = 1;
+	unsigned char stb;
+
+	if (t < USBTMC_MIN_TIMEOUT) t = USBTMC_MIN_TIMEOUT;
+	if (ioctl(d->fd, USBTMC_IOCTL_SET_TIMEOUT, &t) == -1) {
+		if (d->debug) fprintf(stderr,"%s:%d: Unable to set USBTMC timeout (%s)\n", FL, strerror(errno));
+	}
+	if (ioctl(d->fd, USBTMC_IOCTL_CONFIG_TERMCHAR, &tc) == -1) {
+		if (d->debug) fprintf(stderr,"%s:%d: %s: no TermChar support (%s)\n", FL, d->device, strerror(errno));
+	}
+	if (ioctl(d->fd, USBTMC_IOCTL_AUTO_ABORT, &on) == -1) {
+		if (d->debug) fprintf(stderr,"%s:%d: %s: no auto-abort (%s)\n", FL, d->device, strerror(errno));
+	}
+	if (ioctl(d->fd, USBTMC_IOCTL_CLEAR) == -1) {
+		if (d->debug) fprintf(stderr,"%s:%d: %s: device clear failed (%s)\n", FL, d->device, strerror(errno));
+	}
+
+	if (d->usb_probed) {
+		static const char sre[] = "*SRE 16";
+
+		if ((d->usb_wait == USB_WAIT_SRQ) && (write(d->fd, sre, sizeof(sre) -1) < 0)) {
+			if (d->debug) fprintf(stderr,"%s:%d: %s: unable to re-enable SRQ (%s)\n", FL, d->device, strerror(errno));
+		}
+	} else {
+		d->usb_wait = USB_WAIT_READ;
+		if (ioctl(d->fd, USBTMC488_IOCTL_READ_STB, &stb) == 0) {
+			d->usb_wait = usb_srq_probe(d)?USB_WAIT_SRQ:USB_WAIT_STB;
+		}
+		d->usb_probed = true;
+	}
+	if (d->debug) {
+		fprintf(stderr,"%s:%d: %s: waiting on %s\n", FL, d->device
+				, (d->usb_wait == USB_WAIT_SRQ)?"SRQ":(d->usb_wait == USB_WAIT_STB)?"status byte":"read"
+				);
+	}
+#endif
+}
+
+/*
+ * Has the instrument got an answer for us?  If we can't tell
+ * say yes and let the read find out.
+ *
+ */
+bool usb_mav( struct device_s *d ) {
+#ifdef __linux__
+	unsigned char stb;
+
+	if (ioctl(d->fd, USBTMC488_IOCTL_READ_STB, &stb) == 0) return (stb & USBTMC_STB_MAV);
+#endif
+	return true;
+}
+
+/*
+ * Acknowledge an SRQ (so EPOLLPRI drops) and fetch the status
+ * byte that came with it
+ *
+ * Returns the status byte, -1 with errno set on failure
+ *
+ */
+int usb_srq_ack( struct device_s *d ) {
+#ifdef __linux__
+	uint8_t stb;
+
+	if (ioctl(d->fd, USBTMC_IOCTL_GET_SRQ_STB, &stb) == 0) return stb;
+	return -1;
+#else
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+/*
+ * Device clear, throws away any response the instrument still
+ * has queued (after a timeout, say) so it can't be taken as
+ * the answer to the next query.  Only for real usbtmc nodes.
+ *
+ */
+void usb_clear( struct device_s *d ) {
+#ifdef __linux__
+	if ((d->comms_mode == CMODE_USB) && (!d->pollable) && (d->fd >= 0)) ioctl(d->fd, USBTMC_IOCTL_CLEAR);
+#endif
+}
+
+/*
+ * Reader thread, see struct usb_reader_s.  With the status
+ * byte to go on we wait for MAV before reading, otherwise the
+ * read() itself waits, bounded by the driver timeout.
+ *
+ */
+static void *usb_reader_run( void *arg ) {
+	struct device_s *d = (struct device_s *)arg;
+	struct usb_reader_s *r = &(d->reader);
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&(r->lock));
+	while (1) {
+		uint64_t deadline;
+		bool mav = true;
+		ssize_t sz = -1;
+		int err = ETIMEDOUT;
+
+		while ((!r->want) && (!r->quit)) pthread_cond_wait(&(r->cond), &(r->lock));
+		if (r->quit) break;
+		deadline = r->deadline;
+		pthread_mutex_unlock(&(r->lock));
+
+		if (d->usb_wait == USB_WAIT_STB) {
+			while ((!(mav = usb_mav(d))) && (monotonic_us() < deadline)) usleep(USBTMC_STB_POLL);
+		}
+		if (mav) {
+			sz = rx_ring_fill(d->fd, &(d->rx), true);
+			err = errno;
+		}
+
+		pthread_mutex_lock(&(r->lock));
+		r->want = false;
+		r->done = true;
+		r->result = sz;
+		r->err = err;
+		if (write(r->efd, &one, sizeof(one)) < 0) {
+			/* can only be a full counter, the engine will still wake */
+		}
+	}
+	pthread_mutex_unlock(&(r->lock));
+
+	return NULL;
+}
+
+/*
+ * Start the device's reader thread, once, it carries on across
+ * reconnects
+ *
+ * Returns 0 on success, -1 with errno set
+ *
+ */
+int usb_reader_start( struct device_s *d ) {
+	struct usb_reader_s *r = &(d->reader);
+	int err;
+
+	if (r->started) return 0;
+
+	r->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (r->efd < 0) return -1;
+
+	err = pthread_create(&(r->tid), NULL, usb_reader_run, d);
+	if (err != 0) {
+		close(r->efd);
+		r->efd = -1;
+		errno = err;
+		return -1;
+	}
+	r->started = true;
+
+	return 0;
+}
+
+/*
+ * Ask the reader for the next response, due by tx.deadline
+ *
+ */
+void usb_reader_post( struct device_s *d ) {
+	struct usb_reader_s *r = &(d->reader);
+
+	pthread_mutex_lock(&(r->lock));
+	r->deadline = d->tx.deadline;
+	r->want = true;
+	r->done = false;
+	pthread_cond_signal(&(r->cond));
+	pthread_mutex_unlock(&(r->lock));
+	r->busy = true;
+}
+
+/*
+ * Collect a finished read, the ring is ours again
+ *
+ * Returns what rx_ring_fill() did, or -1 with errno EAGAIN if
+ * the read hasn't finished
+ *
+ */
+ssize_t usb_reader_collect( struct device_s *d ) {
+	struct usb_reader_s *r = &(d->reader);
+	uint64_t n;
+	ssize_t sz;
+	int err;
+
+	if (read(r->efd, &n, sizeof(n)) < 0) {
+		/* nothing to clear, we check done regardless */
+	}
+
+	pthread_mutex_lock(&(r->lock));
+	if (!r->done) {
+		pthread_mutex_unlock(&(r->lock));
+		errno = EAGAIN;
+		return -1;
+	}
+	r->done = false;
+	sz = r->result;
+	err = r->err;
+	pthread_mutex_unlock(&(r->lock));
+	r->busy = false;
+
+	if ((sz > 0) && d->capture) capture_data(d->capture, d->index, CAP_RX, d->rx.buf +d->rx.last, d->rx.last_len);
+
+	errno = err;
+	return sz;
+}
+
+/*
+ * Waits for a read in progress to finish (at most the driver
+ * timeout), so do it before closing the handle
+ *
+ */
+void usb_reader_stop( struct device_s *d ) {
+	struct usb_reader_s *r = &(d->reader);
+
+	if (!r->started) return;
+
+	pthread_mutex_lock(&(r->lock));
+	r->quit = true;
+	pthread_cond_signal(&(r->cond));
+	pthread_mutex_unlock(&(r->lock));
+	pthread_join(r->tid, NULL);
+
+	close(r->efd);
+	r->efd = -1;
+	r->started = false;
+	r->busy = r->want = r->done = r->quit = false;
+}
+
+void rx_ring_reset( struct rx_ring_s *rx ) {
+	rx->head = rx->tail = rx->scan = 0;
+}
+
+/*
+ * Pull one '\n' terminated line out of the receive ring
+ *
+ * The terminator (and any '\r') is stripped and the line is
+ * truncated to fit b.
+ *
+ * Returns the line length, or -1 (errno EAGAIN) if there
+ * isn't a complete line buffered yet.
+ *
+ */
+ssize_t rx_ring_frame( struct rx_ring_s *rx, char *b, ssize_t s ) {
+	const uint32_t mask = RX_RING_SIZE -1;
+
+	for (; rx->scan != rx->head; rx->scan++) {
+		if (rx->buf[rx->scan & mask] == '\n') {
+			ssize_t bp = 0;
+
+			while (rx->tail != rx->scan) {
+				char c = rx->buf[rx->tail & mask];
+				rx->tail++;
+				if ((bp < s -1) && (c != '\r')) b[bp++] = c;
+			}
+			rx->tail++; // the '\n'
+			rx->scan = rx->tail;
+			b[bp] = '\0';
+			return bp;
+		}
+	}
+
+	errno = EAGAIN;
+	return -1;
+}
+
+/*
+ * Do one read() from fd in to the ring, taking as much as
+ * the kernel has and we have room for.
+ *
+ * For message based transports (usbtmc) a short read marks
+ * the end of the response, so if the instrument didn't
+ * terminate it we do.
+ *
+ * Returns the bytes read, or -1 with errno set.  A zero
+ * length read is reported as EIO, the far end has gone.
+ *
+ */
+ssize_t rx_ring_fill( int fd, struct rx_ring_s *rx, bool message_based ) {
+	const uint32_t mask = RX_RING_SIZE -1;
+	uint32_t room, off, chunk;
+	ssize_t sz;
+
+	if (rx->head == rx->tail) {
+		rx_ring_reset(rx);
+	}
+
+	room = RX_RING_SIZE -(rx->head -rx->tail);
+	if (room == 0) {
+		/*
+		 * A whole ring without a terminator is garbage,
+		 * drop it and carry on looking
+		 *
+		 */
+		rx_ring_reset(rx);
+		room = RX_RING_SIZE;
+	}
+
+	off = rx->head & mask;
+	chunk = RX_RING_SIZE -off;
+	if (chunk > room) chunk = room;
+
+	sz = read(fd, rx->buf +off, chunk);
+	if (sz < 0) return -1;
+	rx->last = off;
+	if (sz == 0) {
+		errno = EIO;
+		return -1;
+	}
+	rx->head += sz;
+	rx->last_len = sz;
+
+	if (message_based && ((uint32_t)sz < chunk) && (rx->buf[(rx->head -1) & mask] != '\n') && ((uint32_t)sz < room)) {
+		rx->buf[rx->head & mask] = '\n';
+		rx->head++;
+		rx->last_len++;
+	}
+
+	return sz;
+}
+
+/*
+ * rx_ring_fill() for a device, recording what came in if
+ * we're capturing.  The capture gets any terminator we added
+ * to a message too, a replay is a byte stream and needs it to
+ * frame the response.
+ *
+ */
+ssize_t device_fill( struct device_s *d, bool message_based ) {
+	ssize_t sz;
+
+	sz = rx_ring_fill(d->fd, &(d->rx), message_based);
+	if ((sz > 0) && d->capture) capture_data(d->capture, d->index, CAP_RX, d->rx.buf +d->rx.last, d->rx.last_len);
+
+	return sz;
+}
+
+/*
+ * Read one response line from the device, waiting no longer
+ * than the device's io_timeout.
+ *
+ * Returns the line length or -1 with errno set (ETIMEDOUT if
+ * the deadline passed)
+ *
+ */
+int data_read( struct device_s *d, char *b, ssize_t s ) {
+	uint64_t deadline = monotonic_us() + (uint64_t)d->io_timeout *1000;
+
+	while (1) {
+		ssize_t sz = rx_ring_frame(&(d->rx), b, s);
+		if (sz >= 0) return sz;
+
+		if (d->pollable) {
+			int r = wait_readable(d->fd, deadline);
+			if (r == 0) {
+				errno = ETIMEDOUT;
+				return -1;
+			}
+			if (r < 0) return -1;
+		}
+
+		if (device_fill(d, !d->pollable) < 0) {
+			if ((errno == EINTR)||(errno == EAGAIN)) continue;
+			return -1;
+		}
+	}
+}
+
+int data_write( struct device_s *d, const char *b, ssize_t s ) {
+	ssize_t sz;
+
+	do {
+		sz = write(d->fd, b, s);
+	} while ((sz < 0) && (errno == EINTR));
+
+	if (sz < 0) {
+		d->error_flag = true;
+		fprintf(stdout,"%s: Error sending data: %s\n", d->device, strerror(errno));
+	} else if (d->capture) {
+		capture_data(d->capture, d->index, CAP_TX, b, sz);
+	}
+
+	return sz;
+}
+
+/*
+ * Split a combined response such as "12.000;1.500" or the
+ * MEAS:ALL? style "12.000,1.500,18.000" in to its volts and
+ * amps fields, in place.
+ *
+ * Returns 0 on success, -1 if the response did not carry
+ * two fields.
+ *
+ */
+int split_response( char *b, char **volts, char **amps ) {
+	char *p;
+
+	p = strpbrk(b, ";,");
+	if (!p) return -1;
+	*p = '\0';
+	*volts = b;
+	*amps = p +1;
+
+	p = strpbrk(*amps, ";,\r\n");
+	if (p) *p = '\0';
+
+	if ((**volts == '\0')||(**amps == '\0')) return -1;
+
+	return 0;
+}
+
+/*
+ * Does the response start like a number?  Used to tell an
+ * error message from a value.
+ *
+ */
+static bool looks_numeric( const char *b ) {
+	while (*b == ' ') b++;
+	if ((*b == '+')||(*b == '-')) b++;
+	if (*b == '.') b++;
+	return ((*b >= '0')&&(*b <= '9'));
+}
+
+/*
+ * Send a query as part of the current transaction and arm
+ * the deadline for its response
+ *
+ * Returns 0 on success, -1 if the write failed
+ *
+ */
+static int txn_send( struct device_s *d, const char *cmd, uint64_t now ) {
+	if (data_write( d, cmd, strlen(cmd) ) < 0) return -1;
+	d->tx.deadline = now + (uint64_t)d->io_timeout *1000;
+	return 0;
+}
+
+/*
+ * A query has gone out, work out how to wait for its answer
+ *
+ */
+static void txn_await( struct device_s *d, uint64_t now ) {
+	struct txn_s *t = &(d->tx);
+
+	if (d->usb_wait != USB_WAIT_READ) {
+		/* SRQ or the status byte tells us, no need to guess a settle delay */
+		t->state = TX_WAIT;
+	} else if (d->acq_mode == ACQ_LEGACY) {
+		t->state = TX_SETTLE;
+		t->read_after = now +d->profile->settle;
+		t->deadline += d->profile->settle;
+	} else {
+		t->state = TX_WAIT;
+	}
+}
+
+/*
+ * Mark the transaction as failed, the reason is taken from
+ * errno.  The readout gets TIMEOUT/NODATA in place of values.
+ *
+ */
+void txn_fail( struct device_s *d ) {
+	const char *why;
+
+	d->error_flag = true;
+	d->tx.err = errno;
+	if (errno == ETIMEDOUT) {
+		usb_clear(d);
+		d->tx.fail = SAMPLE_TIMEOUT;
+		d->timeouts++;
+		fprintf(stdout,"%s: Timeout reading data (%u so far)\n", d->device, d->timeouts.load());
+		why = "TIMEOUT";
+	} else {
+		d->tx.fail = SAMPLE_NODATA;
+		d->io_errors++;
+		fprintf(stdout,"%s: Error reading data: %s\n", d->device, strerror(errno));
+		why = "NODATA";
+	}
+	snprintf(d->tx.volts, sizeof(d->tx.volts), "%s", why);
+	snprintf(d->tx.amps, sizeof(d->tx.amps), "%s", why);
+
+	if ((d->acq_mode == ACQ_COMPOUND) && (d->tx.step == 1)) {
+		/*
+		 * We got one answer to the compound query and never
+		 * the second, so it isn't really supported
+		 *
+		 */
+		fprintf(stdout,"%s: Incomplete answer to '%s', falling back to pipelined queries\n", d->device, MEAS_COMPOUND);
+		d->acq_mode = ACQ_PIPELINE;
+	}
+
+	/*
+	 * Whatever is left in the ring belongs to the failed
+	 * transaction, make sure it isn't taken as the answer
+	 * to the next one
+	 *
+	 */
+	rx_ring_reset(&(d->rx));
+	d->tx.state = TX_IDLE;
+}
+
+/*
+ * Start a volts/amps transaction according to d->acq_mode
+ *
+ * On return the transaction is either waiting (TX_WAIT /
+ * TX_SETTLE) or has already failed (TX_IDLE, error_flag set)
+ *
+ */
+void txn_begin( struct device_s *d, uint64_t now ) {
+	struct txn_s *t = &(d->tx);
+	int r;
+
+	t->step = 0;
+	t->start = now;
+	t->volts[0] = t->amps[0] = '\0';
+	t->fail = 0;
+	t->err = 0;
+	d->error_flag = false;
+
+	/*
+	 * Anything already buffered is a late answer to some
+	 * earlier query
+	 *
+	 */
+	rx_ring_reset(&(d->rx));
+
+	switch (d->acq_mode) {
+		case ACQ_ALL:
+			r = txn_send(d, d->meas_all, now);
+			break;
+
+		case ACQ_COMPOUND:
+			r = txn_send(d, d->meas_compound, now);
+			break;
+
+		case ACQ_PIPELINE:
+			/*
+			 * Serial devices buffer line input, so we can queue
+			 * both queries and then collect the two responses.
+			 *
+			 * USBTMC is message based, a new query discards any
+			 * unread response, so there each read immediately
+			 * follows its query (see txn_line())
+			 *
+			 */
+			r = txn_send(d, d->meas_volt, now);
+			if ((r == 0) && (d->comms_mode == CMODE_SERIAL)) r = txn_send(d, d->meas_curr, now);
+			break;
+
+		default:
+			r = txn_send(d, d->meas_volt, now);
+			break;
+	}
+
+	if (r < 0) {
+		txn_fail(d);
+		return;
+	}
+
+	txn_await(d, now);
+}
+
+/*
+ * Feed one response line in to the transaction
+ *
+ * Returns TXN_MORE while further responses are expected,
+ * TXN_DONE once tx.volts/tx.amps are final (or it failed)
+ * and TXN_RETRY if the device didn't understand the combined
+ * query and we've fallen back to pipelined queries.
+ *
+ */
+int txn_line( struct device_s *d, char *line, uint64_t now ) {
+	struct txn_s *t = &(d->tx);
+	char *v, *a;
+
+	switch (d->acq_mode) {
+		case ACQ_ALL:
+		case ACQ_COMPOUND:
+			if (t->step == 1) {
+				snprintf(t->amps, sizeof(t->amps), "%s", line);
+				break;
+			}
+
+			if ((d->acq_mode == ACQ_COMPOUND) && (d->comms_mode == CMODE_SERIAL) && (!strpbrk(line, ";,")) && looks_numeric(line)) {
+				/*
+				 * Some firmware answers each query of a compound
+				 * command on its own line, so pick up the second one
+				 *
+				 */
+				snprintf(t->volts, sizeof(t->volts), "%s", line);
+				t->step = 1;
+				t->deadline = now + (uint64_t)d->io_timeout *1000;
+				return TXN_MORE;
+			}
+
+			if (split_response(line, &v, &a) == 0) {
+				snprintf(t->volts, sizeof(t->volts), "%s", v);
+				snprintf(t->amps, sizeof(t->amps), "%s", a);
+				break;
+			}
+
+			fprintf(stdout,"%s: Device did not answer '%s' usefully (%s), falling back to pipelined queries\n"
+					, d->device
+					, (d->acq_mode == ACQ_ALL)?MEAS_ALL:MEAS_COMPOUND
+					, line
+					);
+			d->acq_mode = ACQ_PIPELINE;
+			t->state = TX_IDLE;
+			return TXN_RETRY;
+
+		case ACQ_PIPELINE:
+		case ACQ_LEGACY:
+		default:
+			if (t->step == 1) {
+				snprintf(t->amps, sizeof(t->amps), "%s", line);
+				break;
+			}
+
+			snprintf(t->volts, sizeof(t->volts), "%s", line);
+			t->step = 1;
+			if ((d->acq_mode == ACQ_PIPELINE) && (d->comms_mode == CMODE_SERIAL)) {
+				/* second query is already queued */
+				t->deadline = now + (uint64_t)d->io_timeout *1000;
+				return TXN_MORE;
+			}
+
+			if (txn_send(d, d->meas_curr, now) < 0) {
+				txn_fail(d);
+				return TXN_DONE;
+			}
+			txn_await(d, now);
+			return TXN_MORE;
+	}
+
+	t->state = TX_IDLE;
+	return TXN_DONE;
+}
+
+/*
+ * Fill in a sample from the completed transaction, this is
+ * where the responses become numbers.  Anything that doesn't
+ * parse fails the sample (and counts as an I/O error).
+ *
+ */
+void txn_sample( struct device_s *d, struct sample_s *smp, uint64_t now ) {
+	smp->t_us = now;
+	smp->wall_us = realtime_us();
+	smp->seq = d->seq++;
+	smp->dev = d->index;
+	smp->uv = smp->ua = 0;
+
+	if (!d->error_flag) {
+		if ((parse_micro(d->tx.volts, &(smp->uv)) != 0)||(parse_micro(d->tx.amps, &(smp->ua)) != 0)) {
+			fprintf(stdout,"%s: Unusable reading '%s' / '%s'\n", d->device, d->tx.volts, d->tx.amps);
+			smp->uv = smp->ua = 0;
+			d->error_flag = true;
+			d->tx.fail = SAMPLE_BADVALUE;
+			d->io_errors++;
+		}
+	}
+
+	smp->flags = d->error_flag?(SAMPLE_ERROR | d->tx.fail):0;
+}
+
+/*
+ * Fetch one volts/amps pair from the device, blocking until
+ * the transaction completes or fails.
+ *
+ * Returns 0 on success, -1 on failure (bv/bc then hold
+ * TIMEOUT or NODATA)
+ *
+ */
+int acquire( struct device_s *d, char *bv, size_t bvs, char *bc, size_t bcs ) {
+	txn_begin(d, monotonic_us());
+
+	while (d->tx.state != TX_IDLE) {
+		char b[TXN_RESP_SIZE];
+
+		if (d->tx.state == TX_SETTLE) {
+			uint64_t now = monotonic_us();
+			if (now < d->tx.read_after) usleep(d->tx.read_after -now);
+			d->tx.state = TX_WAIT;
+		}
+		while ((d->usb_wait == USB_WAIT_STB) && (!usb_mav(d)) && (monotonic_us() < d->tx.deadline)) {
+			usleep(USBTMC_STB_POLL);
+		}
+
+		if (data_read(d, b, sizeof(b)) < 0) {
+			txn_fail(d);
+			break;
+		}
+
+		if (txn_line(d, b, monotonic_us()) == TXN_RETRY) {
+			txn_begin(d, monotonic_us());
+		}
+	}
+
+	snprintf(bv, bvs, "%s", d->tx.volts);
+	snprintf(bc, bcs, "%s", d->tx.amps);
+
+	return d->error_flag?-1:0;
+}
@@ -0,0 +1,310 @@
+/*
+ * Multicomp MP7100  / OWON SP3051 / 3101 / 6031 / 5051
+ *
+ * Device transport, USBTMC and serial, and the query/response
+ * transaction that turns them in to volts/amps readings.
+ *
+ */
+
+#ifndef MP7100_TRANSPORT_H
+#define MP7100_TRANSPORT_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <termios.h>
+
+#include "sample.h"
+#include "perf.h"
+#include "fixed.h"
+
+#define FL __FILE__,__LINE__
+
+#define CMODE_USB 1
+#define CMODE_SERIAL 2
+#define CMODE_NONE 0
+
+#define MEAS_VOLT "MEAS:VOLT?"
+#define MEAS_CURR "MEAS:CURR?"
+#define MEAS_COMPOUND "MEAS:VOLT?;MEAS:CURR?"
+#define MEAS_ALL "MEAS:ALL?"
+#define SET_VOLT "VOLT"
+#define SET_CURR "CURR"
+#define SET_OUTPUT "OUTP"
+
+/*
+ * Acquisition modes, in order of increasing throughput.
+ *
+ * LEGACY sends each query, sleeps and then reads, as the
+ * original loop did.  PIPELINE drops the fixed sleeps and
+ * lets the device response pace us.  COMPOUND and ALL fetch
+ * both values in a single transaction.
+ *
+ */
+#define ACQ_LEGACY 0
+#define ACQ_PIPELINE 1
+#define ACQ_COMPOUND 2
+#define ACQ_ALL 3
+
+#define LEGACY_SETTLE_DELAY 20000 // 20ms between query and read
+#define ERROR_RETRY_DELAY 1000000 // 1s between attempts while the device is unhappy
+#define RECONNECT_MIN_DELAY 50000 // us before the first attempt to reopen a lost device
+#define RECONNECT_MAX_DELAY 2000000 // us, the backoff stops doubling here
+
+#define IO_TIMEOUT_DEFAULT 1000 // ms allowed per transaction
+
+/*
+ * Adaptive scheduling, see engine_interval()
+ *
+ */
+#define ADAPT_DV_DEFAULT 1.0 // V/s counted as changing
+#define ADAPT_DI_DEFAULT 0.1 // A/s counted as changing
+#define ADAPT_SPAN 10000 // us, shortest span a rate is measured over
+#define ADAPT_HOLD 250000 // us to stay fast after the last change
+#define USBTMC_MIN_TIMEOUT 100 // ms, the driver refuses anything shorter
+
+/*
+ * How a real usbtmc node tells us a response is ready, best
+ * last, see usb_setup()
+ *
+ */
+#define USB_WAIT_READ 0 // nothing better, read() blocks until the driver timeout
+#define USB_WAIT_STB 1 // poll the status byte for MAV
+#define USB_WAIT_SRQ 2 // instrument raises SRQ on MAV, epoll sees EPOLLPRI
+
+#define USBTMC_STB_MAV 0x10 // IEEE 488.2 message available
+#define USBTMC_STB_POLL 1000 // us between status byte polls
+#define USBTMC_SRQ_PROBE 200 // ms we give the probe's SRQ to arrive
+
+/*
+ * Receive ring for the device.  We pull whatever the kernel
+ * has in one read() and frame '\n' terminated responses out
+ * of it, anything left over stays for the next transaction.
+ *
+ * head/tail are free running, RX_RING_SIZE must be a power
+ * of two.
+ *
+ */
+#define RX_RING_SIZE 1024
+
+struct rx_ring_s {
+	char buf[RX_RING_SIZE];
+	uint32_t head; // next write position
+	uint32_t tail; // next read position
+	uint32_t scan; // how far we've already looked for '\n'
+	uint32_t last; // offset the most recent read() landed at, always contiguous
+	uint32_t last_len; // what it put there, with any terminator we added, see rx_ring_fill()
+};
+
+/*
+ * A real usbtmc node that can't raise SRQ has nothing epoll
+ * can wait on, its read() (and status byte polling) is done
+ * on a thread of its own so it can't hold up the engine or
+ * the other devices.  The engine asks for one read at a time
+ * and is woken through efd when it's finished.  While busy the
+ * reader owns the receive ring, the engine only writes to the
+ * device between reads.
+ *
+ */
+struct usb_reader_s {
+	bool started;
+	pthread_t tid;
+	int efd; // eventfd, readable when a read has finished
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool quit;
+	bool want; // a read has been asked for
+	bool done; // and has finished, result/err are valid
+	bool busy; // engine side, asked for and not yet collected
+	uint64_t deadline;
+	ssize_t result;
+	int err;
+};
+
+struct serial_params_s {
+	char *device;
+	int fd, n;
+	int cnt, size, s_cnt;
+	struct termios oldtp, newtp;
+};
+
+/*
+ * State of the one outstanding query/response transaction a
+ * device may have.
+ *
+ */
+#define TX_IDLE 0
+#define TX_SETTLE 1 // query sent, waiting out the legacy settle delay
+#define TX_WAIT 2 // waiting for a response line
+
+#define TXN_MORE 0 // still waiting on more responses
+#define TXN_DONE 1 // volts/amps are ready
+#define TXN_RETRY 2 // mode changed, start the transaction again
+
+#define TXN_RESP_SIZE 100
+
+struct adapt_s {
+	int keepalive; // us between samples while flat, 0 = adaptive off
+	double dv, di; // thresholds, V/s and A/s
+	int64_t ref_uv, ref_ua; // reading the rate is measured from
+	uint64_t ref_t; // 0 until we have a reference
+	uint64_t fast_until; // keep sampling flat out until then
+};
+
+struct txn_s {
+	int state;
+	int step; // which query of the transaction we're on
+	uint64_t start; // when the first query went out
+	uint64_t deadline; // for the current response
+	uint64_t read_after; // end of the legacy settle delay
+	uint16_t fail; // SAMPLE_ flags saying why it failed
+	int err; // errno it failed with
+	char volts[TXN_RESP_SIZE];
+	char amps[TXN_RESP_SIZE];
+};
+
+/*
+ * Setpoint and output changes waiting to go out (see
+ * control.h), one slot of each kind per device, sent ahead of
+ * the next measurement in slot order: switching the output
+ * off goes before anything else, switching it on only after
+ * the limits it's to come on with.
+ *
+ */
+#define CTL_SLOT_OFF 0
+#define CTL_SLOT_CURR 1
+#define CTL_SLOT_VOLT 2
+#define CTL_SLOT_ON 3
+#define CTL_SLOTS 4
+
+struct ctl_pending_s {
+	bool set;
+	int64_t value; // uV / uA, unused for the output slots
+	uint64_t posted; // monotonic us the (first) command for it was posted
+};
+
+struct model_profile_s;
+
+struct device_s {
+	int index;
+	char *device;
+	int comms_mode;
+	bool debug;
+
+	struct capture_s *capture; // recording everything sent and received, see capture.h
+	bool replay; // fed from a capture rather than a real device, never reopened
+
+	const struct model_profile_s *profile; // see models.h
+	char idn[TXN_RESP_SIZE]; // *IDN? answer, empty if it never gave one
+
+	int fd;
+	bool pollable; // false for real usbtmc nodes, see usb_setup()
+	int usb_wait; // USB_WAIT_, real usbtmc nodes only
+	bool usb_probed; // usb_wait has been worked out, reopens keep it
+	char *serial_parameters_string;
+	struct serial_params_s serial_params;
+	struct rx_ring_s rx;
+	struct usb_reader_s reader;
+
+	char meas_volt[20];
+	char meas_curr[20];
+	char meas_compound[40];
+	char meas_all[20];
+
+	int acq_mode;
+	int io_timeout; // ms
+	int interval; // us between samples
+	struct adapt_s adapt;
+
+	bool error_flag;
+
+	/*
+	 * Setpoints as read at start up and since changed by us,
+	 * and the changes still to be sent.  Engine thread only.
+	 *
+	 */
+	bool have_setpoints;
+	int64_t set_uv, set_ua;
+	int output; // 1 on, 0 off, -1 unknown
+	struct ctl_pending_s pending[CTL_SLOTS];
+	int npending;
+
+	/*
+	 * Link state.  When the handle dies (unplugged, power
+	 * cycled) the engine closes it and tries to reopen it at
+	 * reconnect_at, doubling backoff each time it fails, see
+	 * engine_offline()
+	 *
+	 */
+	bool online;
+	uint64_t reconnect_at;
+	uint64_t backoff; // us
+	uint32_t reconnects;
+
+	std::atomic<uint32_t> timeouts;
+	std::atomic<uint32_t> io_errors;
+
+	/*
+	 * Query to response time of every good transaction,
+	 * written by the engine, read by the HUD
+	 *
+	 */
+	struct perf_hist_s latency;
+	struct perf_hist_s cmd_latency; // posted to sent, per setpoint/output command
+
+	struct txn_s tx;
+	uint64_t next_due; // when the next measurement is due, on the grid of period
+	uint64_t period; // us the grid steps by, 0 = back to back, see engine_schedule()
+	std::atomic<uint32_t> overruns; // grid slots missed because a transaction ran over
+	uint32_t seq;
+
+	/*
+	 * Published samples, produced by the acquisition thread
+	 * and consumed by the display
+	 *
+	 */
+	struct sample_ring_s ring;
+	uint32_t ring_drops;
+};
+
+uint64_t monotonic_us( void );
+uint64_t realtime_us( void );
+int wait_readable( int fd, uint64_t deadline );
+
+void device_init( struct device_s *d, int index, char *path );
+int device_open( struct device_s *d );
+int device_identify( struct device_s *d );
+int device_setpoints( struct device_s *d );
+int device_set( struct device_s *d, int slot, int64_t value );
+void device_close( struct device_s *d );
+
+bool device_gone( int err );
+
+int open_port( struct device_s *d );
+void usb_setup( struct device_s *d );
+bool usb_mav( struct device_s *d );
+int usb_srq_ack( struct device_s *d );
+void usb_clear( struct device_s *d );
+int usb_reader_start( struct device_s *d );
+void usb_reader_post( struct device_s *d );
+ssize_t usb_reader_collect( struct device_s *d );
+void usb_reader_stop( struct device_s *d );
+
+ssize_t rx_ring_frame( struct rx_ring_s *rx, char *b, ssize_t s );
+ssize_t rx_ring_fill( int fd, struct rx_ring_s *rx, bool message_based );
+ssize_t device_fill( struct device_s *d, bool message_based );
+void rx_ring_reset( struct rx_ring_s *rx );
+
+int data_read( struct device_s *d, char *b, ssize_t s );
+int data_write( struct device_s *d, const char *b, ssize_t s );
+
+int split_response( char *b, char **volts, char **amps );
+
+void txn_begin( struct device_s *d, uint64_t now );
+int txn_line( struct device_s *d, char *line, uint64_t now );
+void txn_fail( struct device_s *d );
+void txn_sample( struct device_s *d, struct sample_s *smp, uint64_t now );
+
+int acquire( struct device_s *d, char *bv, size_t bvs, char *bc, size_t bcs );
+
+#endif
@@ -0,0 +1,93 @@
+/*
+ * Multicomp MP7100  / OWON SP3051 / 3101 / 6031 / 5051
+ *
+ * History for the trend strip chart
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "trend.h"
+
+/*
+ * Returns 0 on success, -1 if out of memory
+ *
+ */
+int trend_init( struct trend_s *t, int columns, uint64_t span_us ) {
+	if (columns < 2) columns = 2;
+	if (columns > TREND_MAX_COLUMNS) columns = TREND_MAX_COLUMNS;
+
+	t->columns = columns;
+	t->col_us = span_us /columns;
+	if (t->col_us < 1) t->col_us = 1;
+	t->col_start = 0;
+	t->head = 0;
+	t->col = (struct trend_col_s *)calloc(columns, sizeof(struct trend_col_s));
+
+	return t->col?0:-1;
+}
+
+void trend_free( struct trend_s *t ) {
+	free(t->col);
+	t->col = NULL;
+}
+
+/*
+ * Scroll so the head column covers now, leaving empty
+ * columns for any time nothing arrived in
+ *
+ * Returns true if the chart moved
+ *
+ */
+bool trend_advance( struct trend_s *t, uint64_t now ) {
+	uint64_t steps;
+
+	if ((t->col_start == 0)||(now < t->col_start +t->col_us)) return false;
+
+	steps = (now -t->col_start) /t->col_us;
+	if (steps >= (uint64_t)t->columns) {
+		memset(t->col, 0, t->columns *sizeof(struct trend_col_s));
+		t->col_start += steps *t->col_us;
+		return true;
+	}
+
+	for (uint64_t k = 0; k < steps; k++) {
+		t->head = (t->head +1) % t->columns;
+		t->col[t->head].used = false;
+	}
+	t->col_start += steps *t->col_us;
+
+	return true;
+}
+
+/*
+ * Fold a sample in to the head column, failed samples leave
+ * a gap
+ *
+ * Returns true if the chart changed
+ *
+ */
+bool trend_add( struct trend_s *t, const struct sample_s *smp ) {
+	struct trend_col_s *c;
+	bool changed;
+
+	if (t->col_start == 0) t->col_start = smp->t_us;
+	changed = trend_advance(t, smp->t_us);
+	if (smp->flags & SAMPLE_ERROR) return changed;
+
+	c = &(t->col[t->head]);
+	if (!c->used) {
+		c->v_min = c->v_max = smp->uv;
+		c->a_min = c->a_max = smp->ua;
+		c->used = true;
+		return true;
+	}
+
+	if (smp->uv < c->v_min) { c->v_min = smp->uv; changed = true; }
+	if (smp->uv > c->v_max) { c->v_max = smp->uv; changed = true; }
+	if (smp->ua < c->a_min) { c->a_min = smp->ua; changed = true; }
+	if (smp->ua > c->a_max) { c->a_max = smp->ua; changed = true; }
+
+	return changed;
+}
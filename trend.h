@@ -0,0 +1,48 @@
+/*
+ * Multicomp MP7100  / OWON SP3051 / 3101 / 6031 / 5051
+ *
+ * History for the trend strip chart
+ *
+ */
+
+#ifndef MP7100_TREND_H
+#define MP7100_TREND_H
+
+#include <stdint.h>
+
+#include "sample.h"
+
+#define TREND_MAX_COLUMNS 4096
+
+/*
+ * One pixel column of the chart: the extremes of every
+ * sample that fell in its slice of time
+ *
+ */
+struct trend_col_s {
+	int64_t v_min, v_max; // uV
+	int64_t a_min, a_max; // uA
+	bool used;
+};
+
+/*
+ * Ring of columns, one per pixel across the chart, so the
+ * memory and the cost of drawing depend on the chart width
+ * only, never on how much time it covers or how fast we
+ * sample.  col[head] is the column being filled.
+ *
+ */
+struct trend_s {
+	int columns;
+	uint64_t col_us; // time covered by each column
+	uint64_t col_start; // start of the head column, 0 before the first sample
+	int head;
+	struct trend_col_s *col;
+};
+
+int trend_init( struct trend_s *t, int columns, uint64_t span_us );
+void trend_free( struct trend_s *t );
+bool trend_advance( struct trend_s *t, uint64_t now );
+bool trend_add( struct trend_s *t, const struct sample_s *smp );
+
+#endif